@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpc.h"
+
+/* Defaults */
+#define BENCH_DEFAULT_CALLS 10000000ULL
+#define BENCH_BATCH RPC_RECV_BATCH
+
+static atomic_bool server_running;
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Minimal handler, so the numbers show framing and dispatch cost
+ *
+ * @param argc Argument count
+ * @param argv Argument array
+ * @return Constant string
+ */
+static const char *noop_func(int32_t argc, char **argv) {
+  (void)argc;
+  (void)argv;
+  return "0";
+}
+
+/**
+ * Poll the server end of the loopback until told to stop
+ *
+ * @param arg rpc_transport_t * server end
+ * @return NULL
+ */
+static void *server_loop(void *arg) {
+  rpc_transport_t *server = arg;
+
+  while (atomic_load_explicit(&server_running, memory_order_relaxed)) {
+    /* Give the CPU back when idle, the client may share it */
+    if (rpc_server_poll(server) <= 0) {
+      sched_yield();
+    }
+  }
+  rpc_server_poll_release();
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-n calls] [-m method] [-t]\n"
+          "  -n calls to make (default %llu)\n"
+          "  -m method: noop, echo or hello (default noop)\n"
+          "  -t serve from a second thread instead of inline\n",
+          prog, BENCH_DEFAULT_CALLS);
+}
+
+/**
+ * Drive the dispatch pipeline over the in-memory transport
+ *
+ * @param argc Argument count
+ * @param argv Argument array
+ * @return Exit status code
+ */
+int main(int argc, char **argv) {
+  unsigned long long calls = BENCH_DEFAULT_CALLS;
+  const char *method = "noop";
+  bool threaded = false;
+  char request[MAX_LINE_LENGTH];
+  char replies[BENCH_BATCH][MAX_PACKET_SIZE];
+  rpc_packet_t req_pkts[BENCH_BATCH];
+  rpc_packet_t rep_pkts[BENCH_BATCH];
+  rpc_loopback_t *lb;
+  rpc_transport_t *client;
+  rpc_transport_t *server;
+  pthread_t thread;
+  unsigned long long sent = 0;
+  unsigned long long done = 0;
+  size_t request_len;
+  int64_t start, elapsed;
+  uint32_t window;
+  int32_t n;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:t")) != -1) {
+    switch (opt) {
+    case 'n':
+      calls = strtoull(optarg, NULL, 10);
+      break;
+    case 'm':
+      method = optarg;
+      break;
+    case 't':
+      threaded = true;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (register_str_func("noop", noop_func) != RPC_SUCCESS ||
+      register_str_func("echo", echo_func) != RPC_SUCCESS ||
+      register_str_func("hello", hello_func) != RPC_SUCCESS) {
+    fprintf(stderr, "Failed to register functions\n");
+    return EXIT_FAILURE;
+  }
+
+  lb = rpc_loopback_new();
+  if (lb == NULL) {
+    perror("error rpc_loopback_new");
+    return EXIT_FAILURE;
+  }
+  client = rpc_loopback_client(lb);
+  server = rpc_loopback_server(lb);
+
+  /* Same wire format as the UDP client: null-delimited arguments */
+  request_len = (size_t)snprintf(request, sizeof(request), "%s%c1%c2%c",
+                                 method, '\0', '\0', '\0');
+  memset(req_pkts, 0, sizeof(req_pkts));
+  memset(rep_pkts, 0, sizeof(rep_pkts));
+  for (int32_t i = 0; i < BENCH_BATCH; i++) {
+    req_pkts[i].data = request;
+    req_pkts[i].len = request_len;
+    rep_pkts[i].data = replies[i];
+  }
+
+  if (threaded) {
+    atomic_store(&server_running, true);
+    if (pthread_create(&thread, NULL, server_loop, server) != 0) {
+      perror("error pthread_create");
+      return EXIT_FAILURE;
+    }
+  }
+
+  start = now_ns();
+  while (done < calls) {
+    /* Keep in-flight calls within one ring, so no reply is dropped */
+    window = RPC_LOOPBACK_RING_SIZE - (uint32_t)(sent - done);
+    if (window > BENCH_BATCH) {
+      window = BENCH_BATCH;
+    }
+    if (window > calls - sent) {
+      window = (uint32_t)(calls - sent);
+    }
+    if (window > 0) {
+      n = client->send(client, req_pkts, window);
+      sent += (unsigned long long)(n > 0 ? n : 0);
+    }
+    if (!threaded) {
+      rpc_server_poll(server);
+    }
+    n = client->recv(client, rep_pkts, BENCH_BATCH);
+    if (n > 0) {
+      done += (unsigned long long)n;
+    } else if (threaded) {
+      sched_yield();
+    }
+  }
+  elapsed = now_ns() - start;
+
+  if (threaded) {
+    atomic_store(&server_running, false);
+    pthread_join(thread, NULL);
+  } else {
+    rpc_server_poll_release();
+  }
+
+  printf("method=%s calls=%llu elapsed=%.3fs rate=%.2f Mcalls/s "
+         "ns_per_call=%.1f mode=%s\n",
+         method, calls, elapsed / 1e9, calls / (elapsed / 1e3),
+         (double)elapsed / (double)calls, threaded ? "threaded" : "inline");
+
+  rpc_loopback_free(lb);
+  return EXIT_SUCCESS;
+}
@@ -1,7 +1,9 @@
+#include <arpa/inet.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "rpc.h"
@@ -12,6 +14,9 @@
 /* Flag to indicate server shutdown */
 static volatile sig_atomic_t server_running = 1;
 
+/* Flag to request a trace dump from the main loop */
+static volatile sig_atomic_t trace_dump_requested = 0;
+
 /**
  * Signal handler for graceful shutdown
  *
@@ -20,6 +25,8 @@ static volatile sig_atomic_t server_running = 1;
 static void handle_signal(int sig) {
   if (sig == SIGINT || sig == SIGTERM) {
     server_running = 0;
+  } else if (sig == SIGUSR1) {
+    trace_dump_requested = 1;
   }
 }
 
@@ -61,6 +68,178 @@ const char *add_func(int32_t argc, char **argv) {
   return result;
 }
 
+/**
+ * Publish function implementation - pushes a value to topic subscribers
+ *
+ * @param argc Argument count
+ * @param argv Argument array: topic, value
+ * @return "0" on success or error code
+ */
+const char *publish_func(int32_t argc, char **argv) {
+  if (argc != 2 || argv == NULL || argv[0] == NULL || argv[1] == NULL) {
+    return "-2";
+  }
+
+  return rpc_publish(argv[0], argv[1]) == RPC_SUCCESS ? "0" : "-1";
+}
+
+/**
+ * Print pushes for a topic until interrupted, renewing the lease as we go
+ *
+ * @param topic Topic name
+ * @param port Server port number
+ * @return Exit status code
+ */
+static int subscribe_loop(const char *topic, int32_t port) {
+  char name[MAX_LINE_LENGTH];
+  char value[MAX_PACKET_SIZE];
+  int32_t sock = -1;
+  time_t renew_at = 0;
+
+  while (server_running) {
+    if (time(NULL) >= renew_at) {
+      if (rpc_subscribe(&sock, "127.0.0.1", port, topic,
+                        RPC_DEFAULT_LEASE_SEC) != RPC_SUCCESS) {
+        fprintf(stderr, "Error: Failed to subscribe to '%s' (not published "
+                        "yet?)\n", topic);
+        return EXIT_FAILURE;
+      }
+      renew_at = time(NULL) + RPC_DEFAULT_LEASE_SEC / 2;
+    }
+
+    if (rpc_subscription_recv(sock, 1000, name, sizeof(name), value,
+                              sizeof(value)) == RPC_SUCCESS) {
+      printf("%s %s\n", name, value);
+      fflush(stdout);
+    }
+  }
+
+  close(sock);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Read an integer from the environment
+ *
+ * @param name Variable name
+ * @param def Value used when the variable is not set
+ * @return Parsed value or def
+ */
+static int32_t env_int(const char *name, int32_t def) {
+  const char *value = getenv(name);
+
+  if (value == NULL || *value == '\0') {
+    return def;
+  }
+  return (int32_t)strtol(value, NULL, 10);
+}
+
+/**
+ * Build a server set from a "ip:port,ip:port" list
+ *
+ * @param list Comma separated replica list
+ * @return rpc_client_t * on success, NULL on failure
+ */
+static rpc_client_t *client_from_list(const char *list) {
+  char copy[MAX_LINE_LENGTH];
+  char *saveptr = NULL;
+  char *item;
+  char *colon;
+  rpc_client_t *client;
+  int32_t ret;
+
+  if (strlen(list) >= sizeof(copy)) {
+    return NULL;
+  }
+  strcpy(copy, list);
+
+  client = rpc_client_new();
+  if (client == NULL) {
+    return NULL;
+  }
+
+  for (item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    colon = strchr(item, ':');
+    if (colon != NULL) {
+      *colon = '\0';
+      ret = rpc_client_add_server(client, item, strtol(colon + 1, NULL, 10));
+    } else {
+      ret = rpc_client_add_server(client, item, DEFAULT_RPC_PORT);
+    }
+    if (ret != RPC_SUCCESS) {
+      rpc_client_free(client);
+      return NULL;
+    }
+  }
+
+  if (client->backend_count == 0) {
+    rpc_client_free(client);
+    return NULL;
+  }
+
+  return client;
+}
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Repeat one call through the same client and report its latency spread,
+ * so the balancer and hedging have history to work with
+ *
+ * @param client Server set shared by all calls
+ * @param timeout_ms Time budget per call
+ * @param count Number of calls to make
+ * @param argc Number of arguments (including function name)
+ * @param argv Array of arguments (argv[0] is function name)
+ * @return Exit status code
+ */
+static int repeat_calls(rpc_client_t *client, int32_t timeout_ms,
+                        int32_t count, int32_t argc, char **argv) {
+  char response[MAX_PACKET_SIZE];
+  struct timespec start, end;
+  int64_t *latency_us;
+  int32_t ok = 0;
+  int32_t i;
+
+  latency_us = calloc((size_t)count, sizeof(*latency_us));
+  if (latency_us == NULL) {
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < count; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (rpc_client_call_set(client, timeout_ms, argc, argv, response,
+                            sizeof(response)) == RPC_SUCCESS) {
+      ok++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latency_us[i] = (int64_t)(end.tv_sec - start.tv_sec) * 1000000 +
+                    (end.tv_nsec - start.tv_nsec) / 1000;
+  }
+
+  qsort(latency_us, (size_t)count, sizeof(*latency_us), compare_int64);
+  printf("calls=%d ok=%d p50=%lldus p99=%lldus max=%lldus\n", count, ok,
+         (long long)latency_us[count / 2],
+         (long long)latency_us[(int64_t)count * 99 / 100],
+         (long long)latency_us[count - 1]);
+
+  for (i = 0; i < (int32_t)client->backend_count; i++) {
+    printf("backend %s:%d ewma=%lluus\n",
+           inet_ntoa(client->backends[i].addr.sin_addr),
+           ntohs(client->backends[i].addr.sin_port),
+           (unsigned long long)client->backends[i].ewma_us);
+  }
+
+  free(latency_us);
+  return ok == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 /**
  * Main function - acts as both client and server
  *
@@ -72,14 +251,55 @@ int main(int argc, char **argv) {
   /* Client mode when arguments are provided */
   if (argc > 1) {
     char response[MAX_PACKET_SIZE];
+    const char *servers;
+    rpc_client_t *client;
+    int32_t timeout_ms;
     int32_t ret;
 
+    /* Long-lived subscriber mode */
+    if (argc == 3 && strcmp(argv[1], "subscribe") == 0) {
+      signal(SIGINT, handle_signal);
+      return subscribe_loop(argv[2], env_int("RPC_PORT", DEFAULT_RPC_PORT));
+    }
+
     /* Make RPC call using the client function */
     printf("Sending request: function '%s' with %d arguments\n", argv[1],
            argc - 2);
 
-    ret = rpc_client_call("127.0.0.1", DEFAULT_RPC_PORT, argc - 1, &argv[1],
-                          response, sizeof(response));
+    /* Optional per-call time budget */
+    timeout_ms = env_int("RPC_TIMEOUT_MS", 0);
+
+    servers = getenv("RPC_SERVERS");
+    if (servers != NULL) {
+      /* Balance across the listed replicas */
+      client = client_from_list(servers);
+      if (client == NULL) {
+        fprintf(stderr, "Error: Invalid RPC_SERVERS='%s'\n", servers);
+        return EXIT_FAILURE;
+      }
+      rpc_client_set_hedging(client, env_int("RPC_HEDGE", 0) != 0);
+
+      /* Many calls through one client, reporting p50/p99 */
+      if (env_int("RPC_REPEAT", 0) > 1) {
+        ret = repeat_calls(client, timeout_ms > 0 ? timeout_ms : 5000,
+                           env_int("RPC_REPEAT", 0), argc - 1, &argv[1]);
+        rpc_client_free(client);
+        return ret;
+      }
+
+      ret = rpc_client_call_set(client, timeout_ms > 0 ? timeout_ms : 5000,
+                                argc - 1, &argv[1], response,
+                                sizeof(response));
+      rpc_client_free(client);
+    } else if (timeout_ms > 0) {
+      ret = rpc_client_call_timeout("127.0.0.1",
+                                    env_int("RPC_PORT", DEFAULT_RPC_PORT),
+                                    timeout_ms, argc - 1, &argv[1], response,
+                                    sizeof(response));
+    } else {
+      ret = rpc_client_call("127.0.0.1", env_int("RPC_PORT", DEFAULT_RPC_PORT),
+                            argc - 1, &argv[1], response, sizeof(response));
+    }
 
     if (ret == RPC_SUCCESS) {
       printf("%s\n", response);
@@ -93,6 +313,10 @@ int main(int argc, char **argv) {
   else {
     struct sigaction sa;
     const char *func_name;
+    const char *trace_file;
+    const char *handoff_path;
+    const char *capture_file;
+    rpc_options_t opts;
     int32_t ret;
 
     /* Set up signal handler for graceful shutdown */
@@ -102,7 +326,8 @@ int main(int argc, char **argv) {
     sa.sa_flags = 0;
 
     if (sigaction(SIGINT, &sa, NULL) == -1 ||
-        sigaction(SIGTERM, &sa, NULL) == -1) {
+        sigaction(SIGTERM, &sa, NULL) == -1 ||
+        sigaction(SIGUSR1, &sa, NULL) == -1) {
       perror("Failed to set up signal handler");
       return EXIT_FAILURE;
     }
@@ -129,6 +354,13 @@ int main(int argc, char **argv) {
       return EXIT_FAILURE;
     }
 
+    func_name = "publish";
+    ret = register_str_func(func_name, publish_func);
+    if (ret != RPC_SUCCESS) {
+      fprintf(stderr, "Failed to register %s function\n", func_name);
+      return EXIT_FAILURE;
+    }
+
     func_name = "stop";
     ret = register_str_func(func_name, stop_func);
     if (ret != RPC_SUCCESS) {
@@ -137,17 +369,61 @@ int main(int argc, char **argv) {
     }
 
     /* Initialize RPC server */
-    printf("starting rpc server port=%d...\n", DEFAULT_RPC_PORT);
+    /* Sampled stage tracing, dumped on SIGUSR1 */
+    trace_file = getenv("RPC_TRACE_FILE");
+    if (trace_file == NULL) {
+      trace_file = "rpc_trace.json";
+    }
+    rpc_trace_enable((uint32_t)env_int("RPC_TRACE_SAMPLE", 0));
+
+    memset(&opts, 0, sizeof(opts));
+    opts.port = env_int("RPC_PORT", DEFAULT_RPC_PORT);
+    opts.rcvbuf = env_int("RPC_RCVBUF", 0);
+    opts.sndbuf = env_int("RPC_SNDBUF", 0);
+    opts.hugepages = env_int("RPC_HUGEPAGES", 0) != 0;
+    printf("starting rpc server port=%d...\n", opts.port);
     printf("Use 'Ctrl+C' to stop the server\n");
 
-    rpc_context_t *ctx = rpc_init();
+    /* Take over from a running server if there is one */
+    handoff_path = getenv("RPC_HANDOFF_PATH");
+    rpc_context_t *ctx = NULL;
+    if (handoff_path != NULL) {
+      ctx = rpc_init_handoff(handoff_path, &opts);
+      if (ctx != NULL) {
+        printf("took over listener from %s\n", handoff_path);
+      }
+    }
+    if (ctx == NULL) {
+      ctx = rpc_init_opts(&opts);
+    }
     if (ctx == NULL) {
       perror("error rpc_init");
       return EXIT_FAILURE;
     }
 
+    printf("rcvbuf=%d sndbuf=%d\n", ctx->rcvbuf_bytes, ctx->sndbuf_bytes);
+
+    /* Record incoming traffic for offline replay */
+    capture_file = getenv("RPC_CAPTURE_FILE");
+    if (capture_file != NULL &&
+        rpc_capture_start(capture_file) != RPC_SUCCESS) {
+      fprintf(stderr, "Failed to start capture to %s\n", capture_file);
+    }
+
+    /* Let the next restart take over from us */
+    if (handoff_path != NULL &&
+        rpc_handoff_listen(handoff_path) != RPC_SUCCESS) {
+      fprintf(stderr, "Failed to listen for handoff on %s\n", handoff_path);
+    }
+
     /* Main server loop - waits for signal to shutdown */
     while (atomic_load(&server_running) && atomic_load(&ctx->keep_running)) {
+      if (trace_dump_requested) {
+        trace_dump_requested = 0;
+        if (rpc_trace_dump(trace_file) == RPC_SUCCESS) {
+          printf("trace written to %s\n", trace_file);
+        }
+      }
       sleep(1);
     }
 
@@ -155,8 +431,16 @@ int main(int argc, char **argv) {
     printf("Shutting down server...\n");
 
     /* Cleanup */
+    if (capture_file != NULL) {
+      rpc_capture_stop();
+    }
     rpc_deinit(ctx);
-    printf("RPC server stopped\n");
+    printf("RPC server stopped expired_drops=%llu pushes_sent=%llu "
+           "kernel_drops=%u capture_drops=%llu\n",
+           (unsigned long long)atomic_load(&ctx->expired_drops),
+           (unsigned long long)atomic_load(&ctx->pushes_sent),
+           atomic_load(&ctx->kernel_drops),
+           (unsigned long long)atomic_load(&ctx->capture_drops));
   }
 
   return EXIT_SUCCESS;
@@ -0,0 +1,357 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rpc.h"
+
+/* Defaults */
+#define REPLAY_DEFAULT_WINDOW 32
+#define REPLAY_MAX_WINDOW 1024
+#define REPLAY_TIMEOUT_NS 1000000000LL
+
+/* One outstanding request per socket, so a reply maps to its request */
+typedef struct {
+  int fd;
+  int64_t sent_ns; /* 0 when idle */
+} replay_slot_t;
+
+typedef struct {
+  replay_slot_t slots[REPLAY_MAX_WINDOW];
+  struct pollfd fds[REPLAY_MAX_WINDOW]; /* by slot, fd -1 when idle */
+  struct sockaddr_in addr; /* target server */
+  int32_t window;
+  uint64_t *latency_ns;
+  uint64_t replies;
+  uint64_t lost;
+} replay_state_t;
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**
+ * Open a socket connected to the target for one slot, replacing the old one
+ *
+ * @param st Replay state
+ * @param i Slot index
+ * @return 0 on success, -1 on failure
+ */
+static int32_t open_slot(replay_state_t *st, int32_t i) {
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&st->addr, sizeof(st->addr)) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  if (st->slots[i].fd >= 0) {
+    close(st->slots[i].fd);
+  }
+  st->slots[i].fd = fd;
+  return 0;
+}
+
+/**
+ * Collect replies until wait_ns passes, expiring requests past the timeout
+ *
+ * @param st Replay state
+ * @param wait_ns How long to wait for readable sockets
+ */
+static void poll_replies(replay_state_t *st, int64_t wait_ns) {
+  char buffer[MAX_PACKET_SIZE];
+  struct timespec timeout;
+  int32_t ready;
+  int64_t now;
+
+  /* poll, not select: a large window can put fds above FD_SETSIZE */
+  for (int32_t i = 0; i < st->window; i++) {
+    st->fds[i].fd = st->slots[i].sent_ns != 0 ? st->slots[i].fd : -1;
+    st->fds[i].events = POLLIN;
+    st->fds[i].revents = 0;
+  }
+
+  if (wait_ns < 0) {
+    wait_ns = 0;
+  }
+  timeout.tv_sec = wait_ns / 1000000000LL;
+  timeout.tv_nsec = wait_ns % 1000000000LL;
+
+  ready = ppoll(st->fds, (nfds_t)st->window, &timeout, NULL);
+  now = now_ns();
+
+  for (int32_t i = 0; i < st->window; i++) {
+    replay_slot_t *slot = &st->slots[i];
+
+    if (slot->sent_ns == 0) {
+      continue;
+    }
+
+    if (ready > 0 && (st->fds[i].revents & POLLIN) != 0 &&
+        recv(slot->fd, buffer, sizeof(buffer), 0) >= 0) {
+      st->latency_ns[st->replies++] = (uint64_t)(now - slot->sent_ns);
+      slot->sent_ns = 0;
+    } else if (now - slot->sent_ns > REPLAY_TIMEOUT_NS) {
+      st->lost++;
+      slot->sent_ns = 0;
+      /* A fresh port, so a late reply is not taken for the next request */
+      if (open_slot(st, i) < 0) {
+        perror("error reopen socket");
+      }
+    }
+  }
+}
+
+/**
+ * Find an idle socket, waiting for replies if the window is full
+ *
+ * @param st Replay state
+ * @return Slot index
+ */
+static int32_t acquire_slot(replay_state_t *st) {
+  for (;;) {
+    for (int32_t i = 0; i < st->window; i++) {
+      if (st->slots[i].sent_ns == 0) {
+        return i;
+      }
+    }
+    poll_replies(st, REPLAY_TIMEOUT_NS);
+  }
+}
+
+/**
+ * Skip the captured time budget, replay applies its own timeout
+ *
+ * @param data Datagram
+ * @param len In/out datagram length
+ * @return Start of the call arguments
+ */
+static const char *strip_deadline(const char *data, uint16_t *len) {
+  size_t prefix = sizeof(RPC_DEADLINE_PREFIX) - 1;
+  const char *end;
+
+  if (*len <= prefix || memcmp(data, RPC_DEADLINE_PREFIX, prefix) != 0) {
+    return data;
+  }
+
+  end = memchr(data, '\0', *len);
+  if (end == NULL) {
+    return data;
+  }
+
+  *len = (uint16_t)(*len - (size_t)(end + 1 - data));
+  return end + 1;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s <capture> [-t ip:port] [-s speed] [-w window]\n"
+          "  -t target server (default 127.0.0.1:%d)\n"
+          "  -s pacing: 1 original, 2 twice as fast, 0 as fast as possible\n"
+          "  -w outstanding requests (default %d, max %d)\n",
+          prog, DEFAULT_RPC_PORT, REPLAY_DEFAULT_WINDOW, REPLAY_MAX_WINDOW);
+}
+
+/**
+ * Replay a capture written by rpc_capture_start against a server
+ *
+ * @param argc Argument count
+ * @param argv Argument array
+ * @return Exit status code
+ */
+int main(int argc, char **argv) {
+  static replay_state_t st;
+  const char *target = "127.0.0.1";
+  int32_t port = DEFAULT_RPC_PORT;
+  double speed = 1.0;
+  struct stat sb;
+  const rpc_capture_file_header_t *header;
+  rpc_capture_record_t rec;
+  const char *data;
+  const char *payload;
+  size_t off;
+  uint64_t records = 0;
+  uint64_t sent = 0;
+  uint64_t first_ts = 0;
+  int64_t start, due, elapsed;
+  char host[64];
+  char *colon;
+  uint16_t len;
+  int32_t slot;
+  int fd;
+  int opt;
+
+  st.window = REPLAY_DEFAULT_WINDOW;
+  while ((opt = getopt(argc, argv, "t:s:w:")) != -1) {
+    switch (opt) {
+    case 't':
+      snprintf(host, sizeof(host), "%s", optarg);
+      colon = strchr(host, ':');
+      if (colon != NULL) {
+        *colon = '\0';
+        port = (int32_t)strtol(colon + 1, NULL, 10);
+      }
+      target = host;
+      break;
+    case 's':
+      speed = strtod(optarg, NULL);
+      break;
+    case 'w':
+      st.window = (int32_t)strtol(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind >= argc || speed < 0 || st.window <= 0 ||
+      st.window > REPLAY_MAX_WINDOW) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* Map the capture */
+  fd = open(argv[optind], O_RDONLY);
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    perror("error open capture");
+    return EXIT_FAILURE;
+  }
+  if ((size_t)sb.st_size < sizeof(*header)) {
+    fprintf(stderr, "Error: capture too short\n");
+    return EXIT_FAILURE;
+  }
+
+  data = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("error mmap capture");
+    return EXIT_FAILURE;
+  }
+  madvise((void *)data, (size_t)sb.st_size, MADV_SEQUENTIAL);
+
+  header = (const rpc_capture_file_header_t *)data;
+  if (memcmp(header->magic, RPC_CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != RPC_CAPTURE_VERSION) {
+    fprintf(stderr, "Error: not a capture file\n");
+    return EXIT_FAILURE;
+  }
+
+  /* Count records to size the latency array */
+  for (off = sizeof(*header); off + sizeof(rec) <= (size_t)sb.st_size;
+       off += sizeof(rec) + rec.len) {
+    memcpy(&rec, data + off, sizeof(rec));
+    records++;
+  }
+  st.latency_ns = calloc(records + 1, sizeof(*st.latency_ns));
+  if (st.latency_ns == NULL) {
+    perror("error alloc");
+    return EXIT_FAILURE;
+  }
+
+  /* Connected sockets, one outstanding request each */
+  st.addr.sin_family = AF_INET;
+  st.addr.sin_port = htons((uint16_t)port);
+  if (inet_pton(AF_INET, target, &st.addr.sin_addr) <= 0) {
+    fprintf(stderr, "Error: invalid ipv4=%s\n", target);
+    return EXIT_FAILURE;
+  }
+  for (int32_t i = 0; i < st.window; i++) {
+    st.slots[i].fd = -1;
+    if (open_slot(&st, i) < 0) {
+      perror("error socket");
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf("replaying %llu requests to %s:%d speed=%g window=%d\n",
+         (unsigned long long)records, target, port, speed, st.window);
+
+  start = now_ns();
+  for (off = sizeof(*header); off + sizeof(rec) <= (size_t)sb.st_size;
+       off += sizeof(rec) + rec.len) {
+    memcpy(&rec, data + off, sizeof(rec));
+    if (off + sizeof(rec) + rec.len > (size_t)sb.st_size) {
+      break; /* truncated tail */
+    }
+
+    if (first_ts == 0) {
+      first_ts = rec.ts_ns;
+    }
+
+    /* Keep the original inter-arrival times, scaled by speed */
+    if (speed > 0 && rec.ts_ns > first_ts) {
+      due = start + (int64_t)((double)(rec.ts_ns - first_ts) / speed);
+      while (now_ns() < due) {
+        poll_replies(&st, due - now_ns());
+      }
+    }
+
+    slot = acquire_slot(&st);
+    len = rec.len;
+    payload = strip_deadline(data + off + sizeof(rec), &len);
+    st.slots[slot].sent_ns = now_ns();
+    if (send(st.slots[slot].fd, payload, len, 0) < 0) {
+      st.slots[slot].sent_ns = 0;
+      st.lost++;
+      continue;
+    }
+    sent++;
+
+    /* Drain what is ready without waiting */
+    poll_replies(&st, 0);
+  }
+
+  /* Wait for the stragglers */
+  for (;;) {
+    int32_t busy = 0;
+
+    for (int32_t i = 0; i < st.window; i++) {
+      busy += st.slots[i].sent_ns != 0;
+    }
+    if (busy == 0) {
+      break;
+    }
+    poll_replies(&st, REPLAY_TIMEOUT_NS);
+  }
+  elapsed = now_ns() - start;
+
+  qsort(st.latency_ns, st.replies, sizeof(*st.latency_ns), cmp_u64);
+
+  printf("sent=%llu replies=%llu lost=%llu elapsed=%.3fs throughput=%.0f "
+         "req/s\n",
+         (unsigned long long)sent, (unsigned long long)st.replies,
+         (unsigned long long)st.lost, elapsed / 1e9,
+         elapsed > 0 ? st.replies / (elapsed / 1e9) : 0.0);
+  if (st.replies > 0) {
+    printf("latency_us p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+           st.latency_ns[st.replies * 50 / 100] / 1e3,
+           st.latency_ns[st.replies * 90 / 100] / 1e3,
+           st.latency_ns[st.replies * 99 / 100] / 1e3,
+           st.latency_ns[st.replies - 1] / 1e3);
+  }
+
+  return st.lost == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
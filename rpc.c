@@ -4,23 +4,30 @@
 #include <limits.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
 // constants
 #define RPC_MAX_PACKET_SIZE 4096
 #define RPC_DEFAULT_TIMEOUT_SEC 5
+#define RPC_DEADLINE_PREFIX_LEN (sizeof(RPC_DEADLINE_PREFIX) - 1)
 
 /* Structure to track client requests */
 typedef struct {
   struct sockaddr_in addr;
   socklen_t addr_len;
+  const char *request_id; /* "@id=<n>" argument echoed in the reply, or NULL */
 } client_info_t;
 
 /* Global context */
@@ -30,9 +37,16 @@ static rpc_context_t g_ctx = {0};
 #define RPC_LOG(fmt, ...)                                                      \
   fprintf(stderr, "%s: " fmt "\n", __func__, ##__VA_ARGS__)
 
+/* Per-request chatter, compiled in with -DRPC_DEBUG (make DEBUG=1) */
+#ifdef RPC_DEBUG
+#define RPC_DEBUG_LOG(fmt, ...) RPC_LOG(fmt, ##__VA_ARGS__)
+#else
+#define RPC_DEBUG_LOG(fmt, ...) ((void)0)
+#endif
+
 /* Function implementations */
 const char *hello_func(int32_t argc, char **argv) {
-  RPC_LOG("argc=%d", argc);
+  RPC_DEBUG_LOG("argc=%d", argc);
   static char hello_buffer[RPC_BUFFER_SIZE];
   size_t pos = 0;
   int32_t i;
@@ -197,10 +211,133 @@ static const char *call_function(const char *name, int32_t argc, char **argv) {
   return echo_func(argc, argv);
 }
 
+/* Ancillary space per datagram: RX timestamp and SO_RXQ_OVFL drop counter */
+#define RPC_CMSG_SPACE                                                         \
+  (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+/*
+ * Preallocated packet buffers of a serving thread. The first
+ * RPC_RECV_BATCH buffers receive requests, the rest hold replies until they
+ * are flushed together through the transport.
+ */
+typedef struct {
+  char *base;
+  size_t size;
+  bool huge;
+  rpc_packet_t rx[RPC_RECV_BATCH];
+  rpc_packet_t tx[RPC_RECV_BATCH];
+  uint32_t tx_count;
+  rpc_transport_t *transport; /* where queued replies go */
+} rpc_pool_t;
+
+/* Owned by the thread serving requests */
+static _Thread_local rpc_pool_t t_pool;
+
+/*
+ * Map the buffers from the serving thread so first touch places them on its
+ * NUMA node. Huge pages are used when requested and available.
+ */
+static int32_t rpc_pool_init(rpc_pool_t *pool, bool hugepages) {
+  size_t size = (size_t)RPC_RECV_BATCH * 2 * RPC_MAX_PACKET_SIZE;
+  void *base = MAP_FAILED;
+
+  if (hugepages) {
+    size = (size + RPC_HUGEPAGE_SIZE - 1) & ~((size_t)RPC_HUGEPAGE_SIZE - 1);
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED) {
+      RPC_LOG("no huge pages, fall back to normal pages error='%s'",
+              strerror(errno));
+      size = (size_t)RPC_RECV_BATCH * 2 * RPC_MAX_PACKET_SIZE;
+    }
+  }
+
+  memset(pool, 0, sizeof(*pool));
+  pool->huge = base != MAP_FAILED;
+
+  if (base == MAP_FAILED) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+      RPC_LOG("error map packet pool error='%s'", strerror(errno));
+      return RPC_ERROR;
+    }
+  }
+
+  /* Fault everything in now rather than on the first burst */
+  memset(base, 0, size);
+
+  pool->base = base;
+  pool->size = size;
+
+  for (uint32_t i = 0; i < RPC_RECV_BATCH; i++) {
+    pool->rx[i].data = pool->base + (size_t)i * RPC_MAX_PACKET_SIZE;
+    pool->tx[i].data =
+        pool->base + (size_t)(RPC_RECV_BATCH + i) * RPC_MAX_PACKET_SIZE;
+  }
+
+  return RPC_SUCCESS;
+}
+
+static void rpc_pool_free(rpc_pool_t *pool) {
+  if (pool->base != NULL) {
+    munmap(pool->base, pool->size);
+    pool->base = NULL;
+  }
+}
+
+/*
+ * Send all queued replies with as few transport calls as possible. A send
+ * error belongs to the first unsent reply only, skip it and go on with
+ * the rest as separate sendto calls would. When the transport has no room
+ * the unsent replies stay queued for the next flush.
+ */
+static void rpc_reply_flush(void) {
+  rpc_packet_t pkt;
+  uint32_t done = 0;
+  int32_t sent;
+
+  while (done < t_pool.tx_count) {
+    sent = t_pool.transport->send(t_pool.transport, t_pool.tx + done,
+                                  t_pool.tx_count - done);
+    if (sent < 0) {
+      RPC_LOG("error send res error='%s'", strerror(errno));
+      done++;
+      continue;
+    }
+    if (sent == 0) {
+      break;
+    }
+    done += (uint32_t)sent;
+  }
+
+  /* Swap the unsent replies to the front, each slot keeps its own buffer */
+  for (uint32_t i = 0; done > 0 && done + i < t_pool.tx_count; i++) {
+    pkt = t_pool.tx[i];
+    t_pool.tx[i] = t_pool.tx[done + i];
+    t_pool.tx[done + i] = pkt;
+  }
+  t_pool.tx_count -= done;
+}
+
+/* Latest SO_RXQ_OVFL value, the kernel reports a running total per socket */
+static void rpc_update_kernel_drops(struct msghdr *msg) {
+  struct cmsghdr *cmsg;
+  uint32_t drops;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      atomic_store(&g_ctx.kernel_drops, drops);
+    }
+  }
+}
+
 static void send_result(const char *result, const client_info_t *client) {
-  char buffer[RPC_MAX_PACKET_SIZE];
-  int32_t len;
-  ssize_t sent_bytes;
+  size_t len;
+  size_t id_len = 0;
+  uint32_t slot;
 
   if (client == NULL) {
     return;
@@ -210,16 +347,80 @@ static void send_result(const char *result, const client_info_t *client) {
     result = "";
   }
 
-  len = snprintf(buffer, sizeof(buffer), "%s", result);
-  if ((len < 0) || ((size_t)len >= sizeof(buffer))) {
+  /* The request id leads the reply, terminator included */
+  if (client->request_id != NULL) {
+    id_len = strnlen(client->request_id, RPC_MAX_PACKET_SIZE) + 1;
+  }
+
+  len = strnlen(result, RPC_MAX_PACKET_SIZE);
+  if (id_len + len >= RPC_MAX_PACKET_SIZE) {
     return;
   }
 
-  sent_bytes = sendto(g_ctx.sock_fd, buffer, (size_t)len, 0,
-                      (struct sockaddr *)&client->addr, client->addr_len);
-  if (sent_bytes < 0) {
-    RPC_LOG("error send res error='%s'", strerror(errno));
+  if (t_pool.tx_count == RPC_RECV_BATCH) {
+    rpc_reply_flush();
+    if (t_pool.tx_count == RPC_RECV_BATCH) {
+      RPC_DEBUG_LOG("drop reply, transport full");
+      return;
+    }
+  }
+
+  /* Results often live in static buffers, copy before the next call */
+  slot = t_pool.tx_count++;
+  if (id_len > 0) {
+    memcpy(t_pool.tx[slot].data, client->request_id, id_len);
+  }
+  memcpy(t_pool.tx[slot].data + id_len, result, len);
+  t_pool.tx[slot].len = id_len + len;
+  t_pool.tx[slot].addr = client->addr;
+  t_pool.tx[slot].addr_len = client->addr_len;
+}
+
+/* Monotonic clock in microseconds, used for deadlines, push pacing and
+ * latency tracking */
+static int64_t rpc_mono_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Turn the optional leading "@dl=<ms>" time budget into a local monotonic
+ * deadline in microseconds, counted from arrival_us. The budget is
+ * relative, so clock skew between client and server does not matter.
+ * Returns 0 when the request carries no deadline.
+ */
+static int64_t rpc_parse_deadline(const char *buffer, size_t bufsize,
+                                  int64_t arrival_us) {
+  char digits[24];
+  int64_t budget_ms;
+  size_t i;
+
+  if (buffer == NULL || bufsize <= RPC_DEADLINE_PREFIX_LEN ||
+      memcmp(buffer, RPC_DEADLINE_PREFIX, RPC_DEADLINE_PREFIX_LEN) != 0) {
+    return 0;
+  }
+
+  for (i = 0; i < sizeof(digits) - 1 && RPC_DEADLINE_PREFIX_LEN + i < bufsize;
+       i++) {
+    digits[i] = buffer[RPC_DEADLINE_PREFIX_LEN + i];
+    if (digits[i] == '\0') {
+      break;
+    }
+  }
+  digits[i] = '\0';
+
+  budget_ms = strtoll(digits, NULL, 10);
+  if (budget_ms < 0) {
+    budget_ms = 0;
   }
+
+  return arrival_us + budget_ms * 1000;
+}
+
+static bool rpc_deadline_expired(int64_t deadline_us) {
+  return deadline_us > 0 && rpc_mono_us() >= deadline_us;
 }
 
 static int32_t parse_args(char *buffer, size_t bufsize, int32_t *argc_ptr,
@@ -291,260 +492,2462 @@ static int32_t parse_args(char *buffer, size_t bufsize, int32_t *argc_ptr,
   return 0;
 }
 
-static int32_t rpc_handle_request(char *buffer, ssize_t recv_size,
-                                  client_info_t *client) {
-  char *argv[MAX_ARGS];
-  char **argv_ptr = argv;
-  int32_t argc = 0;
-  const char *result;
-  int32_t parse_result;
+/* Monotonic seconds, used for subscription leases */
+static time_t rpc_mono_sec(void) {
+  struct timespec ts;
 
-  if (buffer == NULL || client == NULL) {
-    return RPC_ERROR;
-  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
 
-  RPC_LOG("recv_size=%zd", recv_size);
+/* Find a topic by name, creating it if requested. Caller holds pubsub_lock */
+static rpc_topic_t *rpc_topic_find(const char *name, bool create) {
+  rpc_topic_t *topic;
+  size_t name_len;
+  int32_t len;
 
-  /* Validate received size */
-  if (recv_size < 0 || recv_size >= RPC_MAX_PACKET_SIZE) {
-    return RPC_ERROR;
+  for (uint32_t i = 0; i < g_ctx.topic_count; i++) {
+    if (strcmp(name, g_ctx.topics[i].name) == 0) {
+      return &g_ctx.topics[i];
+    }
   }
 
-  /* Null-terminate the buffer */
-  buffer[recv_size] = '\0';
-
-  /* Parse arguments */
-  parse_result =
-      parse_args(buffer, (size_t)recv_size, &argc, &argv_ptr, MAX_ARGS);
-  if (parse_result != 0) {
-    RPC_LOG("error parsing arguments res=%d", parse_result);
-    return RPC_ERROR;
+  if (!create || g_ctx.topic_count >= RPC_MAX_TOPICS) {
+    return NULL;
   }
 
-  /* Call the function if we have at least one argument (function name) */
-  if (argc > 0 && argv[0] != NULL) {
-    RPC_LOG("call func=%s argc=%d", argv[0], argc - 1);
-    result = call_function(argv[0], argc - 1, &argv[1]);
-    send_result(result, client);
-    return RPC_SUCCESS;
+  name_len = strlen(name);
+  if (name_len >= sizeof(topic->name)) {
+    return NULL;
   }
 
-  return RPC_ERROR;
-}
-
-static void *rpc_server_thread(void *arg) {
-  fd_set read_fds;
-  int32_t ready;
-  char buffer[RPC_MAX_PACKET_SIZE];
-  ssize_t recv_len;
-  client_info_t client;
-  struct timespec timeout;
-
-  /* Avoid unused parameter warning */
-  (void)arg;
+  topic = &g_ctx.topics[g_ctx.topic_count];
+  memset(topic, 0, sizeof(*topic));
+  memcpy(topic->name, name, name_len + 1);
 
-  while (atomic_load(&g_ctx.keep_running)) {
-    /* Initialize variables for each iteration */
-    timeout.tv_sec = 1;
-    timeout.tv_nsec = 0;
-    client.addr_len = sizeof(client.addr);
+  /* Pre-encode the push header, payload is appended on publish */
+  len = snprintf(topic->message, sizeof(topic->message), "%s%c%s%c",
+                 RPC_PUSH_METHOD, '\0', name, '\0');
+  if (len < 0 || (size_t)len >= sizeof(topic->message)) {
+    return NULL;
+  }
+  topic->header_len = (size_t)len;
+  topic->message_len = topic->header_len;
 
-    /* Set up select */
-    FD_ZERO(&read_fds);
-    FD_SET(g_ctx.sock_fd, &read_fds);
+  g_ctx.topic_count++;
+  return topic;
+}
 
-    ready = pselect(g_ctx.sock_fd + 1, &read_fds, NULL, NULL, &timeout, NULL);
+/* Drop subscribers whose lease ran out. Caller holds pubsub_lock */
+static void rpc_topic_expire(rpc_topic_t *topic, time_t now) {
+  uint32_t i = 0;
 
-    /* Handle select result */
-    if (ready < 0) {
-      if (errno == EINTR) {
-        continue; /* Interrupted by signal */
-      }
-      RPC_LOG("error in pselect error='%s'", strerror(errno));
-      break;
+  while (i < topic->subscriber_count) {
+    if (topic->subscribers[i].lease_expiry <= now) {
+      topic->subscribers[i] = topic->subscribers[topic->subscriber_count - 1];
+      topic->subscriber_count--;
+      continue;
     }
+    i++;
+  }
+}
 
-    if (ready > 0 && FD_ISSET(g_ctx.sock_fd, &read_fds)) {
-      /* Clear buffer before receiving data */
-      memset(buffer, 0, sizeof(buffer));
-
-      /* Receive data */
-      recv_len = recvfrom(g_ctx.sock_fd, buffer, sizeof(buffer) - 1, 0,
-                          (struct sockaddr *)&client.addr, &client.addr_len);
+/* Secret for subscription tokens, drawn on every server start */
+static uint64_t g_sub_key[2];
+
+#define RPC_ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static void rpc_sipround(uint64_t *v) {
+  v[0] += v[1];
+  v[1] = RPC_ROTL64(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = RPC_ROTL64(v[0], 32);
+  v[2] += v[3];
+  v[3] = RPC_ROTL64(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = RPC_ROTL64(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = RPC_ROTL64(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = RPC_ROTL64(v[2], 32);
+}
 
-      /* Process received data */
-      if (recv_len <= 0) {
-        RPC_LOG("error in recvfrom: %s", strerror(errno));
-        continue;
-      }
+/* SipHash-2-4 of data under key */
+static uint64_t rpc_siphash(const uint64_t *key, const uint8_t *data,
+                            size_t len) {
+  uint64_t v[4] = {0x736f6d6570736575ULL ^ key[0],
+                   0x646f72616e646f6dULL ^ key[1],
+                   0x6c7967656e657261ULL ^ key[0],
+                   0x7465646279746573ULL ^ key[1]};
+  uint64_t m;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&m, data + i, sizeof(m));
+    v[3] ^= m;
+    rpc_sipround(v);
+    rpc_sipround(v);
+    v[0] ^= m;
+  }
 
-      /* Handle the request */
-      RPC_LOG("buf=%zd '%s'", recv_len, buffer);
-      rpc_handle_request(buffer, recv_len, &client);
-    }
+  m = (uint64_t)len << 56;
+  for (size_t j = 0; i + j < len; j++) {
+    m |= (uint64_t)data[i + j] << (8 * j);
+  }
+  v[3] ^= m;
+  rpc_sipround(v);
+  rpc_sipround(v);
+  v[0] ^= m;
+
+  v[2] ^= 0xff;
+  for (i = 0; i < 4; i++) {
+    rpc_sipround(v);
   }
 
-  return NULL;
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
 }
 
-int32_t rpc_client_call(const char *server_ip, int32_t port, int32_t argc,
-                        char **argv, char *response, size_t response_size) {
-  int32_t client_sock;
-  struct sockaddr_in server_addr;
-  socklen_t server_len = sizeof(server_addr);
-  ssize_t bytes_sent, bytes_received;
-  struct timeval tv;
-  char request_buffer[RPC_MAX_PACKET_SIZE];
-  int32_t i = 0;
-  size_t pos = 0;
-  int32_t len;
-  size_t remaining;
+/* Draw a fresh token secret, falling back to clock and pid entropy */
+static void rpc_sub_key_init(void) {
+  if (getrandom(g_sub_key, sizeof(g_sub_key), 0) == sizeof(g_sub_key)) {
+    return;
+  }
+  g_sub_key[0] = (uint64_t)rpc_mono_us() ^ ((uint64_t)getpid() << 32);
+  g_sub_key[1] = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL;
+}
 
-  /* Parameter validation */
-  if (argc < 1 || argv == NULL || server_ip == NULL || response == NULL ||
-      response_size == 0) {
-    return RPC_ERROR;
+/*
+ * Token binding a topic to a client address. Only someone who receives
+ * datagrams at that address can echo it back, so a spoofed "@sub" cannot
+ * turn pushes against a third party.
+ */
+static void rpc_subscribe_token(const char *topic, const client_info_t *client,
+                                char *token, size_t token_size) {
+  uint8_t msg[sizeof(uint32_t) + sizeof(uint16_t) + RPC_TOPIC_NAME_SIZE];
+  size_t topic_len = strnlen(topic, RPC_TOPIC_NAME_SIZE);
+  size_t len = 0;
+
+  memcpy(msg, &client->addr.sin_addr.s_addr, sizeof(uint32_t));
+  len += sizeof(uint32_t);
+  memcpy(msg + len, &client->addr.sin_port, sizeof(uint16_t));
+  len += sizeof(uint16_t);
+  memcpy(msg + len, topic, topic_len);
+  len += topic_len;
+
+  snprintf(token, token_size, "%016llx",
+           (unsigned long long)rpc_siphash(g_sub_key, msg, len));
+}
+
+static const char *rpc_subscribe_client(int32_t argc, char **argv,
+                                        const client_info_t *client,
+                                        bool subscribe) {
+  static _Thread_local char challenge[sizeof(RPC_SUBSCRIBE_TOKEN_PREFIX) +
+                                      RPC_SUBSCRIBE_TOKEN_SIZE];
+  char token[RPC_SUBSCRIBE_TOKEN_SIZE];
+  rpc_topic_t *topic;
+  rpc_subscriber_t *sub = NULL;
+  long lease_sec = RPC_DEFAULT_LEASE_SEC;
+  time_t now;
+  uint32_t i;
+
+  if (argc < 1 || argv[0] == NULL) {
+    return "-2";
   }
 
-  /* Build request string with null-byte delimiters */
-  for (i = 0; i < argc; i++) {
-    if (argv[i] == NULL) {
-      continue;
+  if (subscribe && argc > 1 && argv[1] != NULL) {
+    lease_sec = strtol(argv[1], NULL, 10);
+    if (lease_sec <= 0 || lease_sec > RPC_MAX_LEASE_SEC) {
+      return "-2";
     }
+  }
 
-    remaining = RPC_MAX_PACKET_SIZE - pos - 1; /* -1 for final null */
-    if (remaining <= 1) {
-      break;
+  /* Nothing is pushed to an address until it has echoed its token */
+  if (subscribe) {
+    rpc_subscribe_token(argv[0], client, token, sizeof(token));
+    if (argc < 3 || argv[2] == NULL || strcmp(argv[2], token) != 0) {
+      snprintf(challenge, sizeof(challenge), "%s%s",
+               RPC_SUBSCRIBE_TOKEN_PREFIX, token);
+      return challenge;
     }
+  }
 
-    /* Copy argument followed by null terminator */
-    len = snprintf(request_buffer + pos, remaining, "%s%c", argv[i], '\0');
-    if (len < 0 || (size_t)len >= remaining) {
+  now = rpc_mono_sec();
+  pthread_mutex_lock(&g_ctx.pubsub_lock);
+
+  /*
+   * Only handlers create topics (rpc_publish), so clients cannot fill the
+   * table with names nobody publishes.
+   */
+  topic = rpc_topic_find(argv[0], false);
+  if (topic == NULL) {
+    pthread_mutex_unlock(&g_ctx.pubsub_lock);
+    return subscribe ? "-1" : "0";
+  }
+  rpc_topic_expire(topic, now);
+
+  for (i = 0; i < topic->subscriber_count; i++) {
+    if (topic->subscribers[i].addr.sin_addr.s_addr ==
+            client->addr.sin_addr.s_addr &&
+        topic->subscribers[i].addr.sin_port == client->addr.sin_port) {
+      sub = &topic->subscribers[i];
       break;
     }
-    pos += (size_t)len;
   }
 
-  /* Ensure the request is properly terminated */
-  if (pos < RPC_MAX_PACKET_SIZE) {
-    request_buffer[pos] = '\0';
-  } else {
-    request_buffer[RPC_MAX_PACKET_SIZE - 1] = '\0';
+  if (!subscribe) {
+    if (sub != NULL) {
+      *sub = topic->subscribers[topic->subscriber_count - 1];
+      topic->subscriber_count--;
+    }
+    pthread_mutex_unlock(&g_ctx.pubsub_lock);
+    return "0";
   }
 
-  /* Create UDP socket */
-  client_sock = socket(AF_INET, SOCK_DGRAM, 0);
-  if (client_sock < 0) {
-    RPC_LOG("error create socket error='%s'", strerror(errno));
-    return RPC_ERROR;
+  if (sub == NULL) {
+    if (topic->subscriber_count >= RPC_MAX_SUBSCRIBERS) {
+      pthread_mutex_unlock(&g_ctx.pubsub_lock);
+      return "-1";
+    }
+    /* New subscribers get the current value on the next flush */
+    sub = &topic->subscribers[topic->subscriber_count++];
+    sub->addr = client->addr;
+    sub->sent_version = 0;
+    if (topic->version > 0) {
+      atomic_store(&g_ctx.push_pending, true);
+    }
   }
+  sub->lease_expiry = now + lease_sec;
 
-  /* Set socket timeout */
-  tv.tv_sec = RPC_DEFAULT_TIMEOUT_SEC;
-  tv.tv_usec = 0;
-  if (setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-    RPC_LOG("error set socket error='%s'", strerror(errno));
-    close(client_sock);
+  pthread_mutex_unlock(&g_ctx.pubsub_lock);
+  return "0";
+}
+
+int32_t rpc_publish(const char *topic_name, const char *payload) {
+  rpc_topic_t *topic;
+  size_t payload_len;
+  uint64_t one = 1;
+
+  if (topic_name == NULL || payload == NULL ||
+      !atomic_load(&g_ctx.keep_running)) {
     return RPC_ERROR;
   }
 
-  /* Configure server address */
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons((uint16_t)port);
+  pthread_mutex_lock(&g_ctx.pubsub_lock);
 
-  if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-    RPC_LOG("invalid ipv4=%s", server_ip);
-    close(client_sock);
+  topic = rpc_topic_find(topic_name, true);
+  if (topic == NULL) {
+    pthread_mutex_unlock(&g_ctx.pubsub_lock);
     return RPC_ERROR;
   }
 
-  /* Send request to server */
-  bytes_sent = sendto(client_sock, request_buffer, pos, 0,
-                      (struct sockaddr *)&server_addr, server_len);
-  if (bytes_sent < 0) {
-    RPC_LOG("error send error='%s'", strerror(errno));
-    close(client_sock);
+  payload_len = strlen(payload);
+  if (payload_len >= sizeof(topic->message) - topic->header_len) {
+    pthread_mutex_unlock(&g_ctx.pubsub_lock);
     return RPC_ERROR;
   }
 
-  /* Receive response from server */
-  bytes_received = recvfrom(client_sock, response, response_size - 1, 0,
-                            (struct sockaddr *)&server_addr, &server_len);
+  /* Overwrite the previous value, subscribers only see the latest one */
+  memcpy(topic->message + topic->header_len, payload, payload_len);
+  topic->message_len = topic->header_len + payload_len;
+  topic->version++;
 
-  close(client_sock);
+  pthread_mutex_unlock(&g_ctx.pubsub_lock);
 
-  if (bytes_received < 0) {
-    RPC_LOG("error recv res='%s'", strerror(errno));
-    return RPC_ERROR;
+  /* Wake the server thread unless a flush is already pending */
+  if (!atomic_exchange(&g_ctx.push_pending, true)) {
+    if (write(g_ctx.wake_fd, &one, sizeof(one)) < 0) {
+      RPC_LOG("error wake server thread error='%s'", strerror(errno));
+    }
   }
 
-  /* Null-terminate the response */
-  response[bytes_received] = '\0';
   return RPC_SUCCESS;
 }
 
-rpc_context_t *rpc_init(void) {
-  struct sockaddr_in server_addr;
+/* Send a batch of pushes, retrying the tail on partial sends */
+static void rpc_push_send(struct mmsghdr *msgs, uint32_t count) {
+  uint32_t done = 0;
+  int32_t sent;
 
-  /* Initialize the keep_running flag */
-  atomic_store(&g_ctx.keep_running, true);
+  while (done < count) {
+    sent = sendmmsg(g_ctx.sock_fd, msgs + done, count - done, 0);
+    if (sent <= 0) {
+      RPC_LOG("error sendmmsg error='%s'", strerror(errno));
+      return;
+    }
+    done += (uint32_t)sent;
+    atomic_fetch_add(&g_ctx.pushes_sent, (uint64_t)sent);
+  }
+}
 
-  /* Create UDP socket */
-  g_ctx.sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
-  if (g_ctx.sock_fd < 0) {
-    RPC_LOG("error create socket: %s", strerror(errno));
-    return NULL;
+/* Fan out the latest value of every changed topic to its subscribers */
+static void rpc_push_flush(void) {
+  struct mmsghdr msgs[RPC_PUSH_BATCH];
+  struct iovec iovs[RPC_PUSH_BATCH];
+  uint32_t count = 0;
+  rpc_topic_t *topic;
+  rpc_subscriber_t *sub;
+  time_t now;
+
+  atomic_store(&g_ctx.push_pending, false);
+  now = rpc_mono_sec();
+  memset(msgs, 0, sizeof(msgs));
+
+  pthread_mutex_lock(&g_ctx.pubsub_lock);
+  for (uint32_t t = 0; t < g_ctx.topic_count; t++) {
+    topic = &g_ctx.topics[t];
+    if (topic->version == 0) {
+      continue;
+    }
+    rpc_topic_expire(topic, now);
+
+    for (uint32_t i = 0; i < topic->subscriber_count; i++) {
+      sub = &topic->subscribers[i];
+      if (sub->sent_version == topic->version) {
+        continue;
+      }
+      sub->sent_version = topic->version;
+
+      iovs[count].iov_base = topic->message;
+      iovs[count].iov_len = topic->message_len;
+      msgs[count].msg_hdr.msg_name = &sub->addr;
+      msgs[count].msg_hdr.msg_namelen = sizeof(sub->addr);
+      msgs[count].msg_hdr.msg_iov = &iovs[count];
+      msgs[count].msg_hdr.msg_iovlen = 1;
+      count++;
+
+      if (count == RPC_PUSH_BATCH) {
+        rpc_push_send(msgs, count);
+        count = 0;
+      }
+    }
   }
 
-  /* Configure server address */
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  server_addr.sin_port = htons(DEFAULT_RPC_PORT);
+  /* Topic buffers are only stable under the lock, flush the rest here */
+  if (count > 0) {
+    rpc_push_send(msgs, count);
+  }
+  pthread_mutex_unlock(&g_ctx.pubsub_lock);
+}
 
-  /* Bind socket to address */
-  if (bind(g_ctx.sock_fd, (struct sockaddr *)&server_addr,
-           sizeof(server_addr)) < 0) {
-    RPC_LOG("error bind socket: %s", strerror(errno));
-    close(g_ctx.sock_fd);
-    g_ctx.sock_fd = -1;
-    return NULL;
+/*
+ * Ring slot guarded by a sequence number: 2 * n + 1 while span n is being
+ * written, 2 * n + 2 once it is complete
+ */
+typedef struct {
+  atomic_uint_fast64_t seq;
+  rpc_trace_span_t span;
+} rpc_trace_slot_t;
+
+/* Per-thread span ring, written by its owner and read by rpc_trace_dump */
+typedef struct {
+  rpc_trace_slot_t slots[RPC_TRACE_RING_SIZE];
+  atomic_uint_fast64_t head; /* total spans ever committed */
+  uint32_t tid;
+} rpc_trace_ring_t;
+
+static rpc_trace_ring_t *g_trace_rings[RPC_TRACE_MAX_THREADS];
+static atomic_uint g_trace_ring_count;
+static atomic_uint g_trace_sample_every;
+static _Thread_local rpc_trace_ring_t *t_trace_ring;
+static _Thread_local uint32_t t_trace_tick;
+
+static uint64_t rpc_trace_now_ns(void) {
+  struct timespec ts;
+
+  /* Same clock as SO_TIMESTAMPNS so kernel and user stamps line up */
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int32_t rpc_trace_enable(uint32_t sample_every) {
+  /* Kernel RX stamps are always on, deadlines are anchored to them too */
+  atomic_store(&g_trace_sample_every, sample_every);
+  return RPC_SUCCESS;
+}
+
+/* Decide whether the next request on this thread is traced */
+static bool rpc_trace_sample(void) {
+  uint32_t every = atomic_load_explicit(&g_trace_sample_every,
+                                        memory_order_relaxed);
+
+  if (every == 0) {
+    return false;
+  }
+  if (++t_trace_tick < every) {
+    return false;
   }
+  t_trace_tick = 0;
 
-  /* Start server thread */
-  if (pthread_create(&g_ctx.server_thread, NULL, rpc_server_thread, NULL) !=
-      0) {
-    RPC_LOG("error create server thread: %s", strerror(errno));
-    close(g_ctx.sock_fd);
-    g_ctx.sock_fd = -1;
-    return NULL;
+  if (t_trace_ring == NULL) {
+    uint32_t idx = atomic_fetch_add(&g_trace_ring_count, 1);
+
+    if (idx >= RPC_TRACE_MAX_THREADS) {
+      atomic_fetch_sub(&g_trace_ring_count, 1);
+      return false;
+    }
+    /* Rings live as long as the process so a dump never sees a freed one */
+    t_trace_ring = calloc(1, sizeof(*t_trace_ring));
+    if (t_trace_ring == NULL) {
+      atomic_fetch_sub(&g_trace_ring_count, 1);
+      return false;
+    }
+    t_trace_ring->tid = (uint32_t)gettid();
+    g_trace_rings[idx] = t_trace_ring;
   }
 
-  return &g_ctx;
+  return true;
 }
 
-int rpc_deinit(rpc_context_t *ctx) {
-  if (ctx == NULL) {
-    return EINVAL;
+static void rpc_trace_commit(const rpc_trace_span_t *span) {
+  uint64_t head = atomic_load_explicit(&t_trace_ring->head,
+                                       memory_order_relaxed);
+  rpc_trace_slot_t *slot = &t_trace_ring->slots[head % RPC_TRACE_RING_SIZE];
+
+  atomic_store_explicit(&slot->seq, 2 * head + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->span = *span;
+  atomic_store_explicit(&slot->seq, 2 * head + 2, memory_order_release);
+  atomic_store_explicit(&t_trace_ring->head, head + 1, memory_order_release);
+}
+
+/* Copy the method name, masking characters that would break the JSON dump */
+static void rpc_trace_set_method(rpc_trace_span_t *span, const char *name) {
+  size_t i;
+
+  for (i = 0; i < sizeof(span->method) - 1 && name[i] != '\0'; i++) {
+    span->method[i] = (name[i] < 0x20 || name[i] == '"' || name[i] == '\\')
+                          ? '?'
+                          : name[i];
   }
+  span->method[i] = '\0';
+}
 
-  // check if rpc server is running
-  if (!atomic_load(&ctx->keep_running)) {
-    return EINVAL;
+/* Extract the SO_TIMESTAMPNS stamp from a received message, 0 if absent */
+static uint64_t rpc_trace_rx_ns(struct msghdr *msg) {
+  struct cmsghdr *cmsg;
+  struct timespec ts;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
   }
-  /* Signal the server thread to exit */
-  atomic_store(&ctx->keep_running, false);
 
-  /* Join the server thread */
-  if (pthread_join(ctx->server_thread, NULL) != 0) {
-    RPC_LOG("Failed to join server thread: %s", strerror(errno));
+  return 0;
+}
+
+/* One Chrome trace "complete" event, skipped if either stamp is missing */
+static void rpc_trace_write_event(FILE *fp, bool *first, const char *name,
+                                  const char *method, uint32_t tid,
+                                  uint64_t start_ns, uint64_t end_ns) {
+  if (start_ns == 0 || end_ns < start_ns) {
+    return;
   }
 
-  /* Close the socket */
-  if (ctx->sock_fd >= 0) {
-    close(ctx->sock_fd);
+  fprintf(fp,
+          "%s\n{\"name\":\"%s\",\"cat\":\"rpc\",\"ph\":\"X\",\"pid\":%d,"
+          "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"method\":\"%s\"}}",
+          *first ? "" : ",", name, (int)getpid(), tid, start_ns / 1000.0,
+          (end_ns - start_ns) / 1000.0, method);
+  *first = false;
+}
+
+int32_t rpc_trace_dump(const char *path) {
+  FILE *fp;
+  rpc_trace_ring_t *ring;
+  rpc_trace_slot_t *slot;
+  rpc_trace_span_t span;
+  uint64_t head, first_span, seq;
+  uint32_t ring_count;
+  bool first = true;
+
+  if (path == NULL) {
+    return RPC_ERROR;
+  }
+
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    RPC_LOG("error open trace file=%s error='%s'", path, strerror(errno));
+    return RPC_ERROR;
+  }
+
+  fprintf(fp, "{\"traceEvents\":[");
+
+  ring_count = atomic_load(&g_trace_ring_count);
+  for (uint32_t r = 0; r < ring_count && r < RPC_TRACE_MAX_THREADS; r++) {
+    ring = g_trace_rings[r];
+    if (ring == NULL) {
+      continue;
+    }
+
+    /* The owner keeps writing, skip spans overwritten during the copy */
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    first_span = head > RPC_TRACE_RING_SIZE ? head - RPC_TRACE_RING_SIZE : 0;
+    for (uint64_t i = first_span; i < head; i++) {
+      slot = &ring->slots[i % RPC_TRACE_RING_SIZE];
+      seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+      if (seq != 2 * i + 2) {
+        continue;
+      }
+      span = slot->span;
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+        continue;
+      }
+      rpc_trace_write_event(fp, &first, "socket_queue", span.method, ring->tid,
+                            span.rx_ns, span.dequeue_ns);
+      rpc_trace_write_event(fp, &first, "parse", span.method, ring->tid,
+                            span.dequeue_ns, span.parse_ns);
+      rpc_trace_write_event(fp, &first, "dispatch", span.method, ring->tid,
+                            span.dispatch_start_ns, span.dispatch_end_ns);
+      rpc_trace_write_event(fp, &first, "send", span.method, ring->tid,
+                            span.dispatch_end_ns, span.send_ns);
+    }
+  }
+
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+  if (fclose(fp) != 0) {
+    RPC_LOG("error write trace file=%s error='%s'", path, strerror(errno));
+    return RPC_ERROR;
+  }
+
+  return RPC_SUCCESS;
+}
+
+static int32_t rpc_handle_request(char *buffer, ssize_t recv_size,
+                                  client_info_t *client, int64_t deadline_us,
+                                  rpc_trace_span_t *span) {
+  /* Extra slots for the optional deadline and request id arguments */
+  char *args[MAX_ARGS + 2];
+  char **argv = args;
+  char **argv_ptr = args;
+  int32_t argc = 0;
+  const char *result;
+  int32_t parse_result;
+
+  if (buffer == NULL || client == NULL) {
+    return RPC_ERROR;
+  }
+
+  RPC_DEBUG_LOG("recv_size=%zd", recv_size);
+
+  /* Validate received size */
+  if (recv_size < 0 || recv_size >= RPC_MAX_PACKET_SIZE) {
+    return RPC_ERROR;
+  }
+
+  /* Null-terminate the buffer */
+  buffer[recv_size] = '\0';
+
+  /* Parse arguments */
+  parse_result =
+      parse_args(buffer, (size_t)recv_size, &argc, &argv_ptr, MAX_ARGS + 2);
+  if (parse_result != 0) {
+    RPC_LOG("error parsing arguments res=%d", parse_result);
+    return RPC_ERROR;
+  }
+
+  if (span != NULL) {
+    span->parse_ns = rpc_trace_now_ns();
+  }
+
+  /* Skip the deadline and request id, they are not part of the call */
+  if (deadline_us > 0 && argc > 0) {
+    argv++;
+    argc--;
+  }
+  if (argc > 0 && strncmp(argv[0], RPC_REQUEST_ID_PREFIX,
+                          sizeof(RPC_REQUEST_ID_PREFIX) - 1) == 0) {
+    client->request_id = argv[0];
+    argv++;
+    argc--;
+  }
+
+  /* Drop the request if the caller has given up while we were parsing */
+  if (rpc_deadline_expired(deadline_us)) {
+    atomic_fetch_add(&g_ctx.expired_drops, 1);
+    RPC_DEBUG_LOG("drop expired request before dispatch");
+    return RPC_ERROR;
+  }
+
+  /* Reserved subscription methods need the client address */
+  if (argc > 0 && argv[0] != NULL &&
+      (strcmp(argv[0], RPC_SUBSCRIBE_METHOD) == 0 ||
+       strcmp(argv[0], RPC_UNSUBSCRIBE_METHOD) == 0)) {
+    result = rpc_subscribe_client(
+        argc - 1, &argv[1], client,
+        strcmp(argv[0], RPC_SUBSCRIBE_METHOD) == 0);
+    send_result(result, client);
+    return RPC_SUCCESS;
+  }
+
+  /* Call the function if we have at least one argument (function name) */
+  if (argc > 0 && argv[0] != NULL) {
+    RPC_DEBUG_LOG("call func=%s argc=%d", argv[0], argc - 1);
+    if (span != NULL) {
+      rpc_trace_set_method(span, argv[0]);
+      span->dispatch_start_ns = rpc_trace_now_ns();
+    }
+    result = call_function(argv[0], argc - 1, &argv[1]);
+    if (span != NULL) {
+      span->dispatch_end_ns = rpc_trace_now_ns();
+    }
+    send_result(result, client);
+    return RPC_SUCCESS;
+  }
+
+  return RPC_ERROR;
+}
+
+/*
+ * Pass the bound UDP socket to a successor connected on the handoff path.
+ * Returns the connection its ACK arrives on, -1 on failure. The server
+ * thread keeps serving while it waits for the ACK.
+ */
+static int rpc_handoff_send(int listen_fd) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cmsg_buf[CMSG_SPACE(sizeof(int))];
+  char tag = RPC_HANDOFF_ACK;
+  int conn;
+
+  conn = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (conn < 0) {
+    return -1;
+  }
+
+  iov.iov_base = &tag;
+  iov.iov_len = sizeof(tag);
+  memset(&msg, 0, sizeof(msg));
+  memset(cmsg_buf, 0, sizeof(cmsg_buf));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &g_ctx.sock_fd, sizeof(int));
+
+  if (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0) {
+    RPC_LOG("error send handoff error='%s'", strerror(errno));
+    close(conn);
+    return -1;
+  }
+
+  return conn;
+}
+
+/*
+ * Read the successor's ACK from a readable handoff connection.
+ * Returns true once the successor is serving, the listener is then closed,
+ * one handoff per process. The path is left alone: the successor replaces
+ * it with its own listener and unlinking here could remove that one.
+ */
+static bool rpc_handoff_finish(int conn) {
+  char tag = 0;
+  int listen_fd;
+
+  if (recv(conn, &tag, sizeof(tag), 0) != sizeof(tag) ||
+      tag != RPC_HANDOFF_ACK) {
+    RPC_LOG("error handoff not acknowledged, keep serving");
+    close(conn);
+    return false;
+  }
+
+  close(conn);
+  listen_fd = atomic_exchange(&g_ctx.handoff_fd, -1);
+  if (listen_fd >= 0) {
+    close(listen_fd);
+  }
+  RPC_LOG("listener handed off to successor");
+  return true;
+}
+
+/*
+ * Traffic capture. Serving threads append records to a byte ring that a
+ * writer thread drains to the capture file. Any thread may serve through
+ * rpc_server_poll, so producers reserve space with a compare-and-swap on
+ * reserve and never wait for each other. Each reservation starts with a
+ * commit word, 0 until the record behind it is complete; the writer
+ * consumes records in order and zeroes what it consumed, so a reserved
+ * but unfinished record always reads as 0.
+ */
+#define RPC_CAPTURE_ALIGN sizeof(uint64_t)
+
+typedef struct {
+  char *data;
+  atomic_uint_fast64_t reserve; /* bytes reserved by producers */
+  atomic_uint_fast64_t tail; /* bytes consumed, written by the writer thread */
+  FILE *fp;
+  pthread_t writer;
+  atomic_bool active;
+  atomic_bool stopping;
+  atomic_uint users; /* server threads currently appending */
+} rpc_capture_t;
+
+static rpc_capture_t g_capture;
+
+/* Ring bytes one record takes: commit word, record, payload, padding */
+static size_t rpc_capture_span(size_t len) {
+  size_t span = RPC_CAPTURE_ALIGN + sizeof(rpc_capture_record_t) + len;
+
+  return (span + RPC_CAPTURE_ALIGN - 1) & ~(RPC_CAPTURE_ALIGN - 1);
+}
+
+/* Commit word of the reservation at pos, never split by the ring end */
+static atomic_uint_fast64_t *rpc_capture_commit(uint64_t pos) {
+  return (atomic_uint_fast64_t *)(void *)(g_capture.data +
+                                          pos % RPC_CAPTURE_RING_SIZE);
+}
+
+static void rpc_capture_copy_in(uint64_t pos, const void *src, size_t len) {
+  size_t off = (size_t)(pos % RPC_CAPTURE_RING_SIZE);
+  size_t first = RPC_CAPTURE_RING_SIZE - off;
+
+  if (first > len) {
+    first = len;
+  }
+  memcpy(g_capture.data + off, src, first);
+  memcpy(g_capture.data, (const char *)src + first, len - first);
+}
+
+/* Write len ring bytes at pos to the capture file */
+static bool rpc_capture_copy_out(uint64_t pos, size_t len) {
+  size_t off = (size_t)(pos % RPC_CAPTURE_RING_SIZE);
+  size_t first = RPC_CAPTURE_RING_SIZE - off;
+
+  if (first > len) {
+    first = len;
+  }
+  return fwrite(g_capture.data + off, 1, first, g_capture.fp) == first &&
+         fwrite(g_capture.data, 1, len - first, g_capture.fp) == len - first;
+}
+
+/* Zero consumed ring bytes, so a future commit word reads 0 until set */
+static void rpc_capture_zero(uint64_t pos, size_t len) {
+  size_t off = (size_t)(pos % RPC_CAPTURE_RING_SIZE);
+  size_t first = RPC_CAPTURE_RING_SIZE - off;
+
+  if (first > len) {
+    first = len;
+  }
+  memset(g_capture.data + off, 0, first);
+  memset(g_capture.data, 0, len - first);
+}
+
+/* Pin the ring for one receive batch, false when capture is off */
+static bool rpc_capture_enter(void) {
+  if (!atomic_load_explicit(&g_capture.active, memory_order_relaxed)) {
+    return false;
+  }
+
+  atomic_fetch_add(&g_capture.users, 1);
+  if (!atomic_load(&g_capture.active)) {
+    atomic_fetch_sub(&g_capture.users, 1);
+    return false;
+  }
+  return true;
+}
+
+static void rpc_capture_leave(void) { atomic_fetch_sub(&g_capture.users, 1); }
+
+/* Append one datagram, counted as dropped when the writer falls behind */
+static void rpc_capture_packet(uint64_t ts_ns, const struct sockaddr_in *addr,
+                               const char *buffer, size_t len) {
+  rpc_capture_record_t rec;
+  size_t span = rpc_capture_span(len);
+  uint64_t pos, tail;
+
+  pos = atomic_load_explicit(&g_capture.reserve, memory_order_relaxed);
+  do {
+    tail = atomic_load_explicit(&g_capture.tail, memory_order_acquire);
+    if (RPC_CAPTURE_RING_SIZE - (pos - tail) < span) {
+      atomic_fetch_add(&g_ctx.capture_drops, 1);
+      return;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(
+      &g_capture.reserve, &pos, pos + span, memory_order_relaxed,
+      memory_order_relaxed));
+
+  rec.ts_ns = ts_ns;
+  rec.addr = addr->sin_addr.s_addr;
+  rec.port = addr->sin_port;
+  rec.len = (uint16_t)len;
+
+  rpc_capture_copy_in(pos + RPC_CAPTURE_ALIGN, &rec, sizeof(rec));
+  rpc_capture_copy_in(pos + RPC_CAPTURE_ALIGN + sizeof(rec), buffer, len);
+  atomic_store_explicit(rpc_capture_commit(pos), sizeof(rec) + len,
+                        memory_order_release);
+}
+
+static void *rpc_capture_writer(void *arg) {
+  uint64_t tail;
+  uint64_t size;
+  size_t span;
+  struct timespec idle = {0, 1000000};
+  bool stopping;
+  bool wrote;
+
+  (void)arg;
+
+  tail = atomic_load_explicit(&g_capture.tail, memory_order_relaxed);
+  for (;;) {
+    /* Read the flag first so the final drain sees everything produced */
+    stopping = atomic_load(&g_capture.stopping);
+    wrote = false;
+
+    /* Records are consumed in reservation order, up to the first unfinished */
+    for (;;) {
+      size = atomic_load_explicit(rpc_capture_commit(tail),
+                                  memory_order_acquire);
+      if (size == 0) {
+        break;
+      }
+
+      span = rpc_capture_span((size_t)size - sizeof(rpc_capture_record_t));
+      if (!rpc_capture_copy_out(tail + RPC_CAPTURE_ALIGN, (size_t)size)) {
+        RPC_LOG("error write capture error='%s'", strerror(errno));
+      }
+      rpc_capture_zero(tail, span);
+      tail += span;
+      atomic_store_explicit(&g_capture.tail, tail, memory_order_release);
+      wrote = true;
+    }
+
+    if (!wrote) {
+      if (stopping) {
+        break;
+      }
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    /* Flush each pass so a live capture is readable, a crash loses little */
+    if (fflush(g_capture.fp) != 0) {
+      RPC_LOG("error write capture error='%s'", strerror(errno));
+    }
+  }
+
+  return NULL;
+}
+
+int32_t rpc_capture_start(const char *path) {
+  rpc_capture_file_header_t header;
+
+  if (path == NULL || atomic_load(&g_capture.active)) {
+    return RPC_ERROR;
+  }
+
+  /* Zeroed: every commit word reads 0 until a record is complete */
+  g_capture.data = calloc(1, RPC_CAPTURE_RING_SIZE);
+  if (g_capture.data == NULL) {
+    return RPC_ERROR;
+  }
+
+  g_capture.fp = fopen(path, "wb");
+  if (g_capture.fp == NULL) {
+    RPC_LOG("error open capture file=%s error='%s'", path, strerror(errno));
+    free(g_capture.data);
+    g_capture.data = NULL;
+    return RPC_ERROR;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RPC_CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = RPC_CAPTURE_VERSION;
+  if (fwrite(&header, sizeof(header), 1, g_capture.fp) != 1 ||
+      fflush(g_capture.fp) != 0) {
+    RPC_LOG("error write capture file=%s error='%s'", path, strerror(errno));
+    fclose(g_capture.fp);
+    free(g_capture.data);
+    g_capture.data = NULL;
+    return RPC_ERROR;
+  }
+
+  atomic_store(&g_capture.reserve, 0);
+  atomic_store(&g_capture.tail, 0);
+  atomic_store(&g_capture.stopping, false);
+  atomic_store(&g_ctx.capture_drops, 0);
+
+  if (pthread_create(&g_capture.writer, NULL, rpc_capture_writer, NULL) != 0) {
+    RPC_LOG("error create capture thread: %s", strerror(errno));
+    fclose(g_capture.fp);
+    free(g_capture.data);
+    g_capture.data = NULL;
+    return RPC_ERROR;
+  }
+
+  atomic_store(&g_capture.active, true);
+  return RPC_SUCCESS;
+}
+
+int32_t rpc_capture_stop(void) {
+  int32_t ret = RPC_SUCCESS;
+
+  if (!atomic_exchange(&g_capture.active, false)) {
+    return RPC_ERROR;
+  }
+
+  /* Wait out a batch that is still appending, then let the writer drain */
+  while (atomic_load(&g_capture.users) > 0) {
+    sched_yield();
+  }
+  atomic_store(&g_capture.stopping, true);
+
+  if (pthread_join(g_capture.writer, NULL) != 0) {
+    RPC_LOG("Failed to join capture thread: %s", strerror(errno));
+  }
+
+  if (fclose(g_capture.fp) != 0) {
+    ret = RPC_ERROR;
+  }
+  g_capture.fp = NULL;
+  free(g_capture.data);
+  g_capture.data = NULL;
+
+  return ret;
+}
+
+/* Wait up to wait_us for the socket to become readable */
+static int32_t rpc_wait_readable(int32_t sock, int64_t wait_us) {
+  fd_set read_fds;
+  struct timespec timeout;
+  int32_t ready;
+
+  if (wait_us < 0) {
+    wait_us = 0;
+  }
+  timeout.tv_sec = wait_us / 1000000;
+  timeout.tv_nsec = (wait_us % 1000000) * 1000;
+
+  do {
+    FD_ZERO(&read_fds);
+    FD_SET(sock, &read_fds);
+    ready = pselect(sock + 1, &read_fds, NULL, NULL, &timeout, NULL);
+  } while (ready < 0 && errno == EINTR);
+
+  return ready;
+}
+
+/* UDP transport state, one per socket */
+typedef struct {
+  int fd;
+  struct mmsghdr msgs[RPC_RECV_BATCH];
+  struct iovec iov[RPC_RECV_BATCH];
+  char cmsg[RPC_RECV_BATCH][RPC_CMSG_SPACE];
+} rpc_udp_state_t;
+
+static int32_t rpc_udp_recv(rpc_transport_t *transport, rpc_packet_t *pkts,
+                            uint32_t max) {
+  rpc_udp_state_t *st = transport->priv;
+  struct msghdr *msg;
+  int32_t count;
+
+  if (max > RPC_RECV_BATCH) {
+    max = RPC_RECV_BATCH;
+  }
+
+  /* Re-arm the headers, recvmmsg overwrites lengths on return */
+  for (uint32_t i = 0; i < max; i++) {
+    st->iov[i].iov_base = pkts[i].data;
+    st->iov[i].iov_len = RPC_MAX_PACKET_SIZE - 1;
+    memset(&st->msgs[i], 0, sizeof(st->msgs[i]));
+    msg = &st->msgs[i].msg_hdr;
+    msg->msg_name = &pkts[i].addr;
+    msg->msg_namelen = sizeof(pkts[i].addr);
+    msg->msg_iov = &st->iov[i];
+    msg->msg_iovlen = 1;
+    msg->msg_control = st->cmsg[i];
+    msg->msg_controllen = sizeof(st->cmsg[i]);
+  }
+
+  count = recvmmsg(st->fd, st->msgs, max, MSG_DONTWAIT, NULL);
+  if (count <= 0) {
+    if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      RPC_LOG("error in recvmmsg: %s", strerror(errno));
+      return RPC_ERROR;
+    }
+    return 0;
+  }
+
+  for (int32_t i = 0; i < count; i++) {
+    pkts[i].len = st->msgs[i].msg_len;
+    pkts[i].addr_len = st->msgs[i].msg_hdr.msg_namelen;
+    pkts[i].rx_ns = rpc_trace_rx_ns(&st->msgs[i].msg_hdr);
+  }
+  rpc_update_kernel_drops(&st->msgs[count - 1].msg_hdr);
+
+  return count;
+}
+
+static int32_t rpc_udp_send(rpc_transport_t *transport,
+                            const rpc_packet_t *pkts, uint32_t count) {
+  rpc_udp_state_t *st = transport->priv;
+  struct mmsghdr msgs[RPC_RECV_BATCH];
+  struct iovec iov[RPC_RECV_BATCH];
+
+  if (count > RPC_RECV_BATCH) {
+    count = RPC_RECV_BATCH;
+  }
+
+  memset(msgs, 0, count * sizeof(msgs[0]));
+  for (uint32_t i = 0; i < count; i++) {
+    iov[i].iov_base = pkts[i].data;
+    iov[i].iov_len = pkts[i].len;
+    msgs[i].msg_hdr.msg_name = (void *)&pkts[i].addr;
+    msgs[i].msg_hdr.msg_namelen = pkts[i].addr_len;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  return sendmmsg(st->fd, msgs, count, 0);
+}
+
+static int32_t rpc_udp_wait(rpc_transport_t *transport, int64_t wait_us) {
+  rpc_udp_state_t *st = transport->priv;
+
+  return rpc_wait_readable(st->fd, wait_us);
+}
+
+/* Client side: a UDP transport on a fresh unbound socket */
+static int32_t rpc_udp_client_open(rpc_transport_t *transport,
+                                   rpc_udp_state_t *st) {
+  st->fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (st->fd < 0) {
+    RPC_LOG("error create socket error='%s'", strerror(errno));
+    return RPC_ERROR;
+  }
+
+  transport->recv = rpc_udp_recv;
+  transport->send = rpc_udp_send;
+  transport->wait = rpc_udp_wait;
+  transport->priv = st;
+  return RPC_SUCCESS;
+}
+
+static rpc_udp_state_t g_udp_state = {.fd = -1};
+static rpc_transport_t g_udp_transport = {rpc_udp_recv, rpc_udp_send,
+                                          rpc_udp_wait, &g_udp_state};
+
+/* Fixed-size slot of the in-memory transport */
+typedef struct {
+  uint32_t len;
+  char data[RPC_MAX_PACKET_SIZE];
+} rpc_ring_slot_t;
+
+/* Lock-free single-producer single-consumer ring of datagrams */
+typedef struct {
+  _Alignas(64) atomic_uint_fast64_t head; /* written by the producer */
+  _Alignas(64) atomic_uint_fast64_t tail; /* written by the consumer */
+  rpc_ring_slot_t slots[RPC_LOOPBACK_RING_SIZE];
+} rpc_spsc_ring_t;
+
+struct rpc_loopback {
+  rpc_transport_t server;
+  rpc_transport_t client;
+  rpc_spsc_ring_t requests;
+  rpc_spsc_ring_t replies;
+};
+
+static int32_t rpc_ring_push(rpc_spsc_ring_t *ring, const rpc_packet_t *pkts,
+                             uint32_t count) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  rpc_ring_slot_t *slot;
+  uint32_t n;
+
+  for (n = 0; n < count && head - tail < RPC_LOOPBACK_RING_SIZE; n++) {
+    /* Oversized packets are lost, as they would be on the wire */
+    if (pkts[n].len >= RPC_MAX_PACKET_SIZE) {
+      continue;
+    }
+    slot = &ring->slots[head % RPC_LOOPBACK_RING_SIZE];
+    slot->len = (uint32_t)pkts[n].len;
+    memcpy(slot->data, pkts[n].data, pkts[n].len);
+    head++;
+  }
+
+  atomic_store_explicit(&ring->head, head, memory_order_release);
+  return (int32_t)n;
+}
+
+static int32_t rpc_ring_pop(rpc_spsc_ring_t *ring, rpc_packet_t *pkts,
+                            uint32_t max) {
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  rpc_ring_slot_t *slot;
+  uint32_t n;
+
+  for (n = 0; n < max && tail < head; n++) {
+    slot = &ring->slots[tail % RPC_LOOPBACK_RING_SIZE];
+    memcpy(pkts[n].data, slot->data, slot->len);
+    pkts[n].len = slot->len;
+    memset(&pkts[n].addr, 0, sizeof(pkts[n].addr));
+    pkts[n].addr.sin_family = AF_INET;
+    pkts[n].addr_len = sizeof(pkts[n].addr);
+    pkts[n].rx_ns = 0;
+    tail++;
+  }
+
+  atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  return (int32_t)n;
+}
+
+static int32_t rpc_loopback_server_recv(rpc_transport_t *transport,
+                                        rpc_packet_t *pkts, uint32_t max) {
+  rpc_loopback_t *lb = transport->priv;
+
+  return rpc_ring_pop(&lb->requests, pkts, max);
+}
+
+static int32_t rpc_loopback_server_send(rpc_transport_t *transport,
+                                        const rpc_packet_t *pkts,
+                                        uint32_t count) {
+  rpc_loopback_t *lb = transport->priv;
+
+  return rpc_ring_push(&lb->replies, pkts, count);
+}
+
+static int32_t rpc_loopback_client_recv(rpc_transport_t *transport,
+                                        rpc_packet_t *pkts, uint32_t max) {
+  rpc_loopback_t *lb = transport->priv;
+
+  return rpc_ring_pop(&lb->replies, pkts, max);
+}
+
+static int32_t rpc_loopback_client_send(rpc_transport_t *transport,
+                                        const rpc_packet_t *pkts,
+                                        uint32_t count) {
+  rpc_loopback_t *lb = transport->priv;
+
+  return rpc_ring_push(&lb->requests, pkts, count);
+}
+
+rpc_loopback_t *rpc_loopback_new(void) {
+  rpc_loopback_t *lb;
+
+  lb = aligned_alloc(64, sizeof(*lb));
+  if (lb == NULL) {
+    return NULL;
+  }
+
+  atomic_store(&lb->requests.head, 0);
+  atomic_store(&lb->requests.tail, 0);
+  atomic_store(&lb->replies.head, 0);
+  atomic_store(&lb->replies.tail, 0);
+
+  /* aligned_alloc does not zero, no wait hook means callers busy-poll */
+  lb->server.recv = rpc_loopback_server_recv;
+  lb->server.send = rpc_loopback_server_send;
+  lb->server.wait = NULL;
+  lb->server.priv = lb;
+  lb->client.recv = rpc_loopback_client_recv;
+  lb->client.send = rpc_loopback_client_send;
+  lb->client.wait = NULL;
+  lb->client.priv = lb;
+
+  return lb;
+}
+
+void rpc_loopback_free(rpc_loopback_t *lb) { free(lb); }
+
+rpc_transport_t *rpc_loopback_server(rpc_loopback_t *lb) {
+  return lb != NULL ? &lb->server : NULL;
+}
+
+rpc_transport_t *rpc_loopback_client(rpc_loopback_t *lb) {
+  return lb != NULL ? &lb->client : NULL;
+}
+
+/* Receive up to RPC_RECV_BATCH requests from a transport and serve them */
+static int32_t rpc_server_recv_batch(rpc_transport_t *transport) {
+  rpc_trace_span_t spans[RPC_RECV_BATCH];
+  bool traced[RPC_RECV_BATCH];
+  bool any_traced = false;
+  client_info_t client;
+  rpc_packet_t *pkt;
+  int64_t deadline_us;
+  int64_t recv_us;
+  int64_t arrival_us;
+  uint64_t send_ns;
+  uint64_t batch_ns;
+  bool capture;
+  int32_t count;
+
+  /* Backpressure: take no new requests until held back replies are out */
+  if (t_pool.tx_count > 0) {
+    rpc_reply_flush();
+    if (t_pool.tx_count > 0) {
+      return 0;
+    }
+  }
+
+  count = transport->recv(transport, t_pool.rx, RPC_RECV_BATCH);
+  if (count <= 0) {
+    return count;
+  }
+  recv_us = rpc_mono_us();
+  batch_ns = rpc_trace_now_ns();
+  t_pool.transport = transport;
+
+  capture = rpc_capture_enter();
+
+  for (int32_t i = 0; i < count; i++) {
+    pkt = &t_pool.rx[i];
+    client.addr = pkt->addr;
+    client.addr_len = pkt->addr_len;
+    client.request_id = NULL;
+    traced[i] = false;
+
+    if (pkt->len == 0) {
+      continue;
+    }
+    pkt->data[pkt->len] = '\0';
+
+    /* Raw datagram, stamped by the kernel when the transport can */
+    if (capture) {
+      rpc_capture_packet(pkt->rx_ns != 0 ? pkt->rx_ns : batch_ns,
+                         &client.addr, pkt->data, pkt->len);
+    }
+
+    if (rpc_trace_sample()) {
+      memset(&spans[i], 0, sizeof(spans[i]));
+      spans[i].dequeue_ns = batch_ns;
+      spans[i].rx_ns = pkt->rx_ns;
+      traced[i] = true;
+    }
+
+    /* Drop requests whose caller has already timed out */
+    /*
+     * The budget runs from kernel arrival, so waiting in the socket backlog
+     * counts. Both stamps are local wall clock, only their difference is
+     * used, applied to the monotonic clock.
+     */
+    arrival_us = recv_us;
+    if (pkt->rx_ns != 0 && pkt->rx_ns < batch_ns) {
+      arrival_us -= (int64_t)((batch_ns - pkt->rx_ns) / 1000);
+    }
+    deadline_us = rpc_parse_deadline(pkt->data, pkt->len, arrival_us);
+    if (rpc_deadline_expired(deadline_us)) {
+      /* Only count, logging here would cost most when we are saturated */
+      atomic_fetch_add(&g_ctx.expired_drops, 1);
+      RPC_DEBUG_LOG("drop expired request");
+      traced[i] = false;
+      continue;
+    }
+
+    /* Handle the request */
+    RPC_DEBUG_LOG("buf=%zu '%s'", pkt->len, pkt->data);
+    rpc_handle_request(pkt->data, (ssize_t)pkt->len, &client, deadline_us,
+                       traced[i] ? &spans[i] : NULL);
+    any_traced |= traced[i];
+  }
+
+  if (capture) {
+    rpc_capture_leave();
+  }
+
+  /* Replies of the whole batch leave together */
+  rpc_reply_flush();
+
+  if (any_traced) {
+    send_ns = rpc_trace_now_ns();
+    for (int32_t i = 0; i < count; i++) {
+      if (traced[i]) {
+        if (spans[i].dispatch_end_ns != 0) {
+          spans[i].send_ns = send_ns;
+        }
+        rpc_trace_commit(&spans[i]);
+      }
+    }
+  }
+
+  return count;
+}
+
+int32_t rpc_server_poll(rpc_transport_t *transport) {
+  if (transport == NULL || transport->recv == NULL ||
+      transport->send == NULL) {
+    return RPC_ERROR;
+  }
+
+  if (t_pool.base == NULL && rpc_pool_init(&t_pool, false) != RPC_SUCCESS) {
+    return RPC_ERROR;
+  }
+
+  return rpc_server_recv_batch(transport);
+}
+
+void rpc_server_poll_release(void) { rpc_pool_free(&t_pool); }
+
+static void *rpc_server_thread(void *arg) {
+  fd_set read_fds;
+  int32_t ready;
+  struct timespec timeout;
+  int64_t last_flush_us = 0;
+  int64_t wait_us;
+  uint64_t wakeups;
+  int32_t max_fd;
+  int handoff_fd;
+  int handoff_conn = -1;
+  int64_t handoff_deadline_us = 0;
+
+  /* Avoid unused parameter warning */
+  (void)arg;
+
+  if (rpc_pool_init(&t_pool, g_ctx.hugepages) != RPC_SUCCESS) {
+    atomic_store(&g_ctx.keep_running, false);
+    return NULL;
+  }
+  atomic_store(&g_ctx.pool_hugepages, t_pool.huge);
+
+  while (atomic_load(&g_ctx.keep_running)) {
+    /* Initialize variables for each iteration */
+    timeout.tv_sec = 1;
+    timeout.tv_nsec = 0;
+
+    /* Flush pending pushes, at most once per coalescing window */
+    if (atomic_load(&g_ctx.push_pending)) {
+      wait_us = last_flush_us + RPC_PUSH_COALESCE_MS * 1000 - rpc_mono_us();
+      if (wait_us <= 0) {
+        rpc_push_flush();
+        last_flush_us = rpc_mono_us();
+      } else {
+        /* Never longer than one window, whatever the clock did */
+        if (wait_us > RPC_PUSH_COALESCE_MS * 1000) {
+          wait_us = RPC_PUSH_COALESCE_MS * 1000;
+        }
+        timeout.tv_sec = wait_us / 1000000;
+        timeout.tv_nsec = (wait_us % 1000000) * 1000;
+      }
+    }
+
+    /* Set up select */
+    FD_ZERO(&read_fds);
+    FD_SET(g_ctx.sock_fd, &read_fds);
+    max_fd = g_ctx.sock_fd;
+    if (g_ctx.wake_fd >= 0) {
+      FD_SET(g_ctx.wake_fd, &read_fds);
+      if (g_ctx.wake_fd > max_fd) {
+        max_fd = g_ctx.wake_fd;
+      }
+    }
+    /* Wait for a successor, or for the ACK of the one being handed off */
+    handoff_fd = handoff_conn >= 0 ? handoff_conn
+                                   : atomic_load(&g_ctx.handoff_fd);
+    if (handoff_fd >= 0) {
+      FD_SET(handoff_fd, &read_fds);
+      if (handoff_fd > max_fd) {
+        max_fd = handoff_fd;
+      }
+    }
+
+    ready = pselect(max_fd + 1, &read_fds, NULL, NULL, &timeout, NULL);
+
+    /* Handle select result */
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue; /* Interrupted by signal */
+      }
+      RPC_LOG("error in pselect error='%s'", strerror(errno));
+      break;
+    }
+
+    if (ready > 0 && handoff_fd >= 0 && FD_ISSET(handoff_fd, &read_fds)) {
+      if (handoff_conn < 0) {
+        /* Keep serving until the ACK, both share the same queue */
+        handoff_conn = rpc_handoff_send(handoff_fd);
+        handoff_deadline_us =
+            rpc_mono_us() + (int64_t)RPC_DEFAULT_TIMEOUT_SEC * 1000000;
+      } else if (rpc_handoff_finish(handoff_conn)) {
+        /* The successor took the listener, stop reading and let it drain */
+        handoff_conn = -1;
+        atomic_store(&g_ctx.keep_running, false);
+        break;
+      } else {
+        handoff_conn = -1;
+      }
+    } else if (handoff_conn >= 0 && rpc_mono_us() >= handoff_deadline_us) {
+      RPC_LOG("error handoff not acknowledged, keep serving");
+      close(handoff_conn);
+      handoff_conn = -1;
+    }
+
+    /* Publish wakeup, the flush happens at the top of the loop */
+    if (ready > 0 && g_ctx.wake_fd >= 0 && FD_ISSET(g_ctx.wake_fd, &read_fds)) {
+      if (read(g_ctx.wake_fd, &wakeups, sizeof(wakeups)) < 0 &&
+          errno != EAGAIN) {
+        RPC_LOG("error read wake fd error='%s'", strerror(errno));
+      }
+    }
+
+    if (ready > 0 && FD_ISSET(g_ctx.sock_fd, &read_fds)) {
+      rpc_server_recv_batch(&g_udp_transport);
+    }
+  }
+
+  if (handoff_conn >= 0) {
+    close(handoff_conn);
+  }
+  rpc_pool_free(&t_pool);
+  return NULL;
+}
+
+int32_t rpc_client_call(const char *server_ip, int32_t port, int32_t argc,
+                        char **argv, char *response, size_t response_size) {
+  return rpc_client_call_timeout(server_ip, port,
+                                 RPC_DEFAULT_TIMEOUT_SEC * 1000, argc, argv,
+                                 response, response_size);
+}
+
+/*
+ * Build a null-delimited request led by the time budget argument and, when
+ * request_id is not 0, the request id argument.
+ * Returns the request length, 0 on failure.
+ */
+static size_t rpc_build_request(char *request_buffer, int32_t timeout_ms,
+                                uint64_t request_id, int32_t argc,
+                                char **argv) {
+  int32_t i = 0;
+  size_t pos = 0;
+  int32_t len;
+  size_t remaining;
+
+  /* Lead with the time budget so the server can drop the call once we quit */
+  len = snprintf(request_buffer, RPC_MAX_PACKET_SIZE, "%s%d%c",
+                 RPC_DEADLINE_PREFIX, timeout_ms, '\0');
+  if (len < 0 || (size_t)len >= RPC_MAX_PACKET_SIZE) {
+    return 0;
+  }
+  pos = (size_t)len;
+
+  /* Then the id the server echoes, so a late reply is not taken for ours */
+  if (request_id != 0) {
+    len = snprintf(request_buffer + pos, RPC_MAX_PACKET_SIZE - pos,
+                   "%s%llu%c", RPC_REQUEST_ID_PREFIX,
+                   (unsigned long long)request_id, '\0');
+    if (len < 0 || (size_t)len >= RPC_MAX_PACKET_SIZE - pos) {
+      return 0;
+    }
+    pos += (size_t)len;
+  }
+
+  /* Build request string with null-byte delimiters */
+  for (i = 0; i < argc; i++) {
+    if (argv[i] == NULL) {
+      continue;
+    }
+
+    remaining = RPC_MAX_PACKET_SIZE - pos - 1; /* -1 for final null */
+    if (remaining <= 1) {
+      break;
+    }
+
+    /* Copy argument followed by null terminator */
+    len = snprintf(request_buffer + pos, remaining, "%s%c", argv[i], '\0');
+    if (len < 0 || (size_t)len >= remaining) {
+      break;
+    }
+    pos += (size_t)len;
+  }
+
+  /* Ensure the request is properly terminated */
+  if (pos < RPC_MAX_PACKET_SIZE) {
+    request_buffer[pos] = '\0';
+  } else {
+    request_buffer[RPC_MAX_PACKET_SIZE - 1] = '\0';
+  }
+
+  return pos;
+}
+
+/* Ids for matching replies to requests, unique within the process */
+static atomic_uint_fast64_t g_request_id;
+
+static uint64_t rpc_next_request_id(void) {
+  return atomic_fetch_add(&g_request_id, 1) + 1;
+}
+
+/*
+ * Return where the result of a reply to request_id starts, NULL when the
+ * reply belongs to another request.
+ */
+static const char *rpc_reply_result(const char *reply, size_t len,
+                                    uint64_t request_id, size_t *result_len) {
+  char expected[32];
+  int32_t id_len;
+
+  id_len = snprintf(expected, sizeof(expected), "%s%llu",
+                    RPC_REQUEST_ID_PREFIX, (unsigned long long)request_id);
+  if (id_len < 0 || (size_t)id_len >= len ||
+      memcmp(reply, expected, (size_t)id_len + 1) != 0) {
+    return NULL;
+  }
+
+  *result_len = len - (size_t)id_len - 1;
+  return reply + id_len + 1;
+}
+
+/*
+ * Send one request over a transport and wait for the response. The
+ * transport's wait hook sleeps until a reply may be ready, without one
+ * the call busy-polls. to is the server address, NULL when the transport
+ * has a single peer.
+ */
+static int32_t rpc_transport_request(rpc_transport_t *transport,
+                                     const struct sockaddr_in *to,
+                                     int32_t timeout_ms, int32_t argc,
+                                     char **argv, char *response,
+                                     size_t response_size) {
+  char request_buffer[RPC_MAX_PACKET_SIZE];
+  char reply_buffer[RPC_MAX_PACKET_SIZE];
+  uint64_t request_id = rpc_next_request_id();
+  const char *result = NULL;
+  size_t result_len = 0;
+  rpc_packet_t pkt;
+  int64_t deadline_us, now_us;
+  uint32_t spins = 0;
+  int32_t ret;
+  size_t pos;
+
+  /* Parameter validation */
+  if (transport == NULL || argc < 1 || argv == NULL || response == NULL ||
+      response_size == 0 || timeout_ms <= 0) {
+    return RPC_ERROR;
+  }
+
+  pos = rpc_build_request(request_buffer, timeout_ms, request_id, argc, argv);
+  if (pos == 0) {
+    return RPC_ERROR;
+  }
+
+  memset(&pkt, 0, sizeof(pkt));
+  pkt.data = request_buffer;
+  pkt.len = pos;
+  if (to != NULL) {
+    pkt.addr = *to;
+    pkt.addr_len = sizeof(*to);
+  }
+  deadline_us = rpc_mono_us() + (int64_t)timeout_ms * 1000;
+
+  /* Only check the clock every few hundred spins when busy-polling */
+  while ((ret = transport->send(transport, &pkt, 1)) == 0) {
+    if ((++spins & 0xff) == 0 && rpc_mono_us() >= deadline_us) {
+      return RPC_ERROR;
+    }
+  }
+  if (ret < 0) {
+    RPC_LOG("error send error='%s'", strerror(errno));
+    return RPC_ERROR;
+  }
+
+  pkt.data = reply_buffer;
+  while (result == NULL) {
+    ret = transport->recv(transport, &pkt, 1);
+    if (ret < 0) {
+      return RPC_ERROR;
+    }
+    if (ret > 0) {
+      /* Late replies to earlier calls that timed out are skipped */
+      result = rpc_reply_result(reply_buffer, pkt.len, request_id, &result_len);
+      continue;
+    }
+
+    if (transport->wait == NULL && (++spins & 0xff) != 0) {
+      continue;
+    }
+    now_us = rpc_mono_us();
+    if (now_us >= deadline_us) {
+      RPC_LOG("error recv res='timeout'");
+      return RPC_ERROR;
+    }
+    if (transport->wait != NULL &&
+        transport->wait(transport, deadline_us - now_us) < 0) {
+      RPC_LOG("error wait error='%s'", strerror(errno));
+      return RPC_ERROR;
+    }
+  }
+
+  if (result_len >= response_size) {
+    result_len = response_size - 1;
+  }
+  memcpy(response, result, result_len);
+  response[result_len] = '\0';
+  return RPC_SUCCESS;
+}
+
+int32_t rpc_client_call_timeout(const char *server_ip, int32_t port,
+                                int32_t timeout_ms, int32_t argc, char **argv,
+                                char *response, size_t response_size) {
+  rpc_transport_t transport;
+  rpc_udp_state_t st;
+  struct sockaddr_in server_addr;
+  int32_t ret;
+
+  if (server_ip == NULL) {
+    return RPC_ERROR;
+  }
+
+  /* Configure server address */
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons((uint16_t)port);
+
+  if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+    RPC_LOG("invalid ipv4=%s", server_ip);
+    return RPC_ERROR;
+  }
+
+  if (rpc_udp_client_open(&transport, &st) != RPC_SUCCESS) {
+    return RPC_ERROR;
+  }
+
+  ret = rpc_transport_request(&transport, &server_addr, timeout_ms, argc, argv,
+                              response, response_size);
+
+  close(st.fd);
+  return ret;
+}
+
+/*
+ * Pushes that arrived while rpc_subscribe waited for its reply. Only the
+ * latest value per socket and topic is kept, rpc_subscription_recv hands
+ * them out before reading the socket again.
+ */
+typedef struct {
+  bool used;
+  int32_t sock;
+  size_t len;
+  char data[RPC_BUFFER_SIZE];
+} rpc_pending_push_t;
+
+static rpc_pending_push_t g_pending_pushes[RPC_MAX_TOPICS];
+static pthread_mutex_t g_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void rpc_push_stash(int32_t sock, const char *push, size_t len) {
+  const char *name = push + sizeof(RPC_PUSH_METHOD);
+  rpc_pending_push_t *slot = NULL;
+  int32_t i;
+
+  if (len <= sizeof(RPC_PUSH_METHOD) || len > RPC_BUFFER_SIZE) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_pending_lock);
+  for (i = 0; i < RPC_MAX_TOPICS; i++) {
+    if (!g_pending_pushes[i].used) {
+      if (slot == NULL) {
+        slot = &g_pending_pushes[i];
+      }
+    } else if (g_pending_pushes[i].sock == sock &&
+               strcmp(g_pending_pushes[i].data + sizeof(RPC_PUSH_METHOD),
+                      name) == 0) {
+      slot = &g_pending_pushes[i];
+      break;
+    }
+  }
+  if (slot != NULL) {
+    slot->used = true;
+    slot->sock = sock;
+    slot->len = len;
+    memcpy(slot->data, push, len);
+  } else {
+    RPC_DEBUG_LOG("drop pending push sock=%d", sock);
+  }
+  pthread_mutex_unlock(&g_pending_lock);
+}
+
+/* Take a stashed push for sock, returns its length or 0 when none */
+static size_t rpc_push_take(int32_t sock, char *buffer, size_t size) {
+  size_t len = 0;
+  int32_t i;
+
+  pthread_mutex_lock(&g_pending_lock);
+  for (i = 0; i < RPC_MAX_TOPICS; i++) {
+    if (g_pending_pushes[i].used && g_pending_pushes[i].sock == sock) {
+      len = g_pending_pushes[i].len < size ? g_pending_pushes[i].len : size;
+      memcpy(buffer, g_pending_pushes[i].data, len);
+      g_pending_pushes[i].used = false;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_pending_lock);
+  return len;
+}
+
+/* Forget stashed pushes of a socket that is being (re)opened or closed */
+static void rpc_push_discard(int32_t sock) {
+  int32_t i;
+
+  pthread_mutex_lock(&g_pending_lock);
+  for (i = 0; i < RPC_MAX_TOPICS; i++) {
+    if (g_pending_pushes[i].sock == sock) {
+      g_pending_pushes[i].used = false;
+    }
+  }
+  pthread_mutex_unlock(&g_pending_lock);
+}
+
+/*
+ * Wait up to timeout_ms for a reply. Pushes arriving meanwhile are kept for
+ * rpc_subscription_recv, the server does not send them again.
+ */
+static int32_t rpc_recv_reply(int32_t sock, int32_t timeout_ms, char *response,
+                              size_t response_size) {
+  struct timeval tv;
+  ssize_t bytes_received;
+  size_t method_len = sizeof(RPC_PUSH_METHOD);
+
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+    RPC_LOG("error set socket error='%s'", strerror(errno));
+    return RPC_ERROR;
+  }
+
+  do {
+    bytes_received = recv(sock, response, response_size - 1, 0);
+    if (bytes_received < 0) {
+      RPC_LOG("error recv res='%s'", strerror(errno));
+      return RPC_ERROR;
+    }
+    response[bytes_received] = '\0';
+    if ((size_t)bytes_received <= method_len ||
+        memcmp(response, RPC_PUSH_METHOD, method_len) != 0) {
+      break;
+    }
+    rpc_push_stash(sock, response, (size_t)bytes_received);
+  } while (true);
+
+  return RPC_SUCCESS;
+}
+
+int32_t rpc_subscribe(int32_t *sock, const char *server_ip, int32_t port,
+                      const char *topic, int32_t lease_sec) {
+  struct sockaddr_in server_addr;
+  char request_buffer[RPC_MAX_PACKET_SIZE];
+  char response[RPC_BUFFER_SIZE];
+  char lease[16];
+  char *argv[4];
+  size_t pos;
+  bool opened = false;
+
+  if (sock == NULL || server_ip == NULL || topic == NULL || lease_sec <= 0) {
+    return RPC_ERROR;
+  }
+
+  snprintf(lease, sizeof(lease), "%d", lease_sec);
+  argv[0] = RPC_SUBSCRIBE_METHOD;
+  argv[1] = (char *)topic;
+  argv[2] = lease;
+
+  pos = rpc_build_request(request_buffer, RPC_DEFAULT_TIMEOUT_SEC * 1000, 0, 3,
+                          argv);
+  if (pos == 0) {
+    return RPC_ERROR;
+  }
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons((uint16_t)port);
+  if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+    RPC_LOG("invalid ipv4=%s", server_ip);
+    return RPC_ERROR;
+  }
+
+  /* Pushes arrive on the subscribing socket, so keep it open across calls */
+  if (*sock < 0) {
+    *sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (*sock < 0) {
+      RPC_LOG("error create socket error='%s'", strerror(errno));
+      return RPC_ERROR;
+    }
+    if (connect(*sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
+        0) {
+      RPC_LOG("error connect error='%s'", strerror(errno));
+      close(*sock);
+      *sock = -1;
+      return RPC_ERROR;
+    }
+    rpc_push_discard(*sock);
+    opened = true;
+  }
+
+  /* The first reply is a token challenge, echo it to prove the address */
+  if (send(*sock, request_buffer, pos, 0) < 0 ||
+      rpc_recv_reply(*sock, RPC_DEFAULT_TIMEOUT_SEC * 1000, response,
+                     sizeof(response)) != RPC_SUCCESS) {
+    response[0] = '\0';
+  } else if (strncmp(response, RPC_SUBSCRIBE_TOKEN_PREFIX,
+                     sizeof(RPC_SUBSCRIBE_TOKEN_PREFIX) - 1) == 0) {
+    argv[3] = response + sizeof(RPC_SUBSCRIBE_TOKEN_PREFIX) - 1;
+    pos = rpc_build_request(request_buffer, RPC_DEFAULT_TIMEOUT_SEC * 1000, 0,
+                            4, argv);
+    if (pos == 0 || send(*sock, request_buffer, pos, 0) < 0 ||
+        rpc_recv_reply(*sock, RPC_DEFAULT_TIMEOUT_SEC * 1000, response,
+                       sizeof(response)) != RPC_SUCCESS) {
+      response[0] = '\0';
+    }
+  }
+
+  if (strcmp(response, "0") != 0) {
+    RPC_LOG("error subscribe topic=%s", topic);
+    if (opened) {
+      rpc_push_discard(*sock);
+      close(*sock);
+      *sock = -1;
+    }
+    return RPC_ERROR;
+  }
+
+  return RPC_SUCCESS;
+}
+
+int32_t rpc_subscription_recv(int32_t sock, int32_t timeout_ms, char *topic,
+                              size_t topic_size, char *payload,
+                              size_t payload_size) {
+  char buffer[RPC_MAX_PACKET_SIZE];
+  struct timeval tv;
+  ssize_t bytes_received;
+  size_t method_len = sizeof(RPC_PUSH_METHOD);
+  size_t topic_len;
+  const char *body;
+
+  if (sock < 0 || topic == NULL || topic_size == 0 || payload == NULL ||
+      payload_size == 0 || timeout_ms <= 0) {
+    return RPC_ERROR;
+  }
+
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+    RPC_LOG("error set socket error='%s'", strerror(errno));
+    return RPC_ERROR;
+  }
+
+  for (;;) {
+    bytes_received = (ssize_t)rpc_push_take(sock, buffer, sizeof(buffer) - 1);
+    if (bytes_received == 0) {
+      bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    }
+    if (bytes_received < 0) {
+      return RPC_ERROR;
+    }
+    buffer[bytes_received] = '\0';
+
+    /* Push layout: "@pub\0<topic>\0<payload>", stray replies are skipped */
+    if ((size_t)bytes_received > method_len &&
+        memcmp(buffer, RPC_PUSH_METHOD, method_len) == 0) {
+      break;
+    }
+  }
+
+  topic_len = strlen(buffer + method_len);
+  body = buffer + method_len + topic_len + 1;
+  if (body > buffer + bytes_received) {
+    body = buffer + bytes_received;
+  }
+
+  snprintf(topic, topic_size, "%s", buffer + method_len);
+  snprintf(payload, payload_size, "%s", body);
+  return RPC_SUCCESS;
+}
+
+rpc_client_t *rpc_client_new(void) {
+  rpc_client_t *client;
+
+  client = calloc(1, sizeof(*client));
+  if (client == NULL) {
+    return NULL;
+  }
+
+  if (pthread_mutex_init(&client->lock, NULL) != 0) {
+    free(client);
+    return NULL;
+  }
+  client->rng = (uint32_t)rpc_mono_us() | 1U;
+
+  return client;
+}
+
+void rpc_client_free(rpc_client_t *client) {
+  if (client == NULL) {
+    return;
+  }
+
+  pthread_mutex_destroy(&client->lock);
+  free(client);
+}
+
+int32_t rpc_client_add_server(rpc_client_t *client, const char *server_ip,
+                              int32_t port) {
+  rpc_backend_t *backend;
+
+  if (client == NULL || server_ip == NULL || port <= 0 || port > UINT16_MAX) {
+    return RPC_ERROR;
+  }
+
+  if (client->backend_count >= RPC_MAX_BACKENDS) {
+    return RPC_ERROR;
+  }
+
+  backend = &client->backends[client->backend_count];
+  memset(&backend->addr, 0, sizeof(backend->addr));
+  backend->addr.sin_family = AF_INET;
+  backend->addr.sin_port = htons((uint16_t)port);
+
+  if (inet_pton(AF_INET, server_ip, &backend->addr.sin_addr) <= 0) {
+    RPC_LOG("invalid ipv4=%s", server_ip);
+    return RPC_ERROR;
+  }
+
+  atomic_store(&backend->in_flight, 0);
+  backend->ewma_us = 0;
+  client->backend_count++;
+
+  return RPC_SUCCESS;
+}
+
+void rpc_client_set_hedging(rpc_client_t *client, bool enable) {
+  if (client != NULL) {
+    client->hedging = enable;
+  }
+}
+
+/* Expected cost of a backend: smoothed latency scaled by its queue depth */
+static uint64_t rpc_backend_cost(rpc_backend_t *backend) {
+  uint64_t in_flight = atomic_load(&backend->in_flight);
+
+  /* Unmeasured backends look cheap so they get probed */
+  return (backend->ewma_us + 1) * (in_flight + 1);
+}
+
+/* Power-of-two-choices pick, never returns exclude when there is a choice */
+static int32_t rpc_client_pick(rpc_client_t *client, int32_t exclude) {
+  uint32_t count = client->backend_count;
+  uint32_t a, b;
+
+  if (count == 1) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&client->lock);
+  /* xorshift32 */
+  client->rng ^= client->rng << 13;
+  client->rng ^= client->rng >> 17;
+  client->rng ^= client->rng << 5;
+  a = client->rng % count;
+  b = (a + 1 + (client->rng >> 16) % (count - 1)) % count;
+
+  if ((int32_t)a != exclude &&
+      ((int32_t)b == exclude || rpc_backend_cost(&client->backends[a]) <=
+                                    rpc_backend_cost(&client->backends[b]))) {
+    b = a;
+  }
+  pthread_mutex_unlock(&client->lock);
+
+  return (int32_t)b;
+}
+
+/*
+ * Feed a latency into the backend's average. Unanswered calls are charged the
+ * time waited so dead replicas stop being picked, but only real replies enter
+ * the p95 window used for hedging.
+ */
+static void rpc_client_record(rpc_client_t *client, rpc_backend_t *backend,
+                              int64_t latency_us, bool answered) {
+  pthread_mutex_lock(&client->lock);
+  if (backend->ewma_us == 0) {
+    backend->ewma_us = (uint64_t)latency_us;
+  } else {
+    /* alpha = 1/8 */
+    backend->ewma_us = (backend->ewma_us * 7 + (uint64_t)latency_us) / 8;
+  }
+  if (!answered) {
+    pthread_mutex_unlock(&client->lock);
+    return;
+  }
+  client->latency_us[client->latency_pos % RPC_LATENCY_WINDOW] =
+      (uint32_t)(latency_us > UINT32_MAX ? UINT32_MAX : latency_us);
+  client->latency_pos++;
+  pthread_mutex_unlock(&client->lock);
+}
+
+static int rpc_cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* p95 of recent call latencies, -1 until the window has enough samples */
+static int64_t rpc_client_p95_us(rpc_client_t *client) {
+  uint32_t samples[RPC_LATENCY_WINDOW];
+  uint32_t count;
+
+  pthread_mutex_lock(&client->lock);
+  count = client->latency_pos < RPC_LATENCY_WINDOW ? client->latency_pos
+                                                    : RPC_LATENCY_WINDOW;
+  memcpy(samples, client->latency_us, count * sizeof(samples[0]));
+  pthread_mutex_unlock(&client->lock);
+
+  if (count < RPC_HEDGE_MIN_SAMPLES) {
+    return -1;
+  }
+
+  qsort(samples, count, sizeof(samples[0]), rpc_cmp_u32);
+  return samples[(count * 95) / 100];
+}
+
+int32_t rpc_client_call_set(rpc_client_t *client, int32_t timeout_ms,
+                            int32_t argc, char **argv, char *response,
+                            size_t response_size) {
+  char request_buffer[RPC_MAX_PACKET_SIZE];
+  char reply_buffer[RPC_MAX_PACKET_SIZE];
+  uint64_t request_id = rpc_next_request_id();
+  const char *result;
+  size_t result_len;
+  int32_t sent[2] = {-1, -1};
+  int64_t sent_at[2] = {0, 0};
+  int32_t sent_count = 0;
+  int32_t winner = -1;
+  int64_t start_us, deadline_us, hedge_us, now_us;
+  rpc_transport_t transport;
+  rpc_udp_state_t st;
+  rpc_packet_t pkt;
+  size_t pos;
+  int32_t ready;
+  int32_t i;
+
+  /* Parameter validation */
+  if (client == NULL || client->backend_count == 0 || argc < 1 ||
+      argv == NULL || response == NULL || response_size == 0 ||
+      timeout_ms <= 0) {
+    return RPC_ERROR;
+  }
+
+  pos = rpc_build_request(request_buffer, timeout_ms, request_id, argc, argv);
+  if (pos == 0) {
+    return RPC_ERROR;
+  }
+
+  if (rpc_udp_client_open(&transport, &st) != RPC_SUCCESS) {
+    return RPC_ERROR;
+  }
+
+  start_us = rpc_mono_us();
+  deadline_us = start_us + (int64_t)timeout_ms * 1000;
+  hedge_us = -1;
+  if (client->hedging && client->backend_count > 1) {
+    hedge_us = rpc_client_p95_us(client);
+  }
+
+  while (winner < 0) {
+    /* Send the primary, then the hedged duplicate once the p95 delay passes */
+    if (sent_count == 0 || (sent_count == 1 && hedge_us >= 0 &&
+                            rpc_mono_us() - start_us >= hedge_us)) {
+      i = rpc_client_pick(client, sent_count == 0 ? -1 : sent[0]);
+      /* The hedge only gets what is left of the budget, never longer */
+      if (sent_count == 1) {
+        pos = rpc_build_request(
+            request_buffer,
+            (int32_t)((deadline_us - rpc_mono_us() + 999) / 1000), request_id,
+            argc, argv);
+      }
+      memset(&pkt, 0, sizeof(pkt));
+      pkt.data = request_buffer;
+      pkt.len = pos;
+      pkt.addr = client->backends[i].addr;
+      pkt.addr_len = sizeof(pkt.addr);
+      if (transport.send(&transport, &pkt, 1) <= 0) {
+        RPC_LOG("error send error='%s'", strerror(errno));
+        if (sent_count == 0) {
+          break;
+        }
+        hedge_us = -1; /* hedge send failed, do not retry */
+      } else {
+        atomic_fetch_add(&client->backends[i].in_flight, 1);
+        sent[sent_count] = i;
+        sent_at[sent_count] = rpc_mono_us();
+        sent_count++;
+      }
+    }
+
+    now_us = rpc_mono_us();
+    if (now_us >= deadline_us) {
+      RPC_LOG("error recv res='timeout'");
+      break;
+    }
+
+    /* Sleep until the reply, the hedge point or the deadline */
+    if (sent_count == 1 && hedge_us >= 0 &&
+        start_us + hedge_us < deadline_us) {
+      ready = transport.wait(&transport, start_us + hedge_us - now_us);
+    } else {
+      ready = transport.wait(&transport, deadline_us - now_us);
+    }
+
+    if (ready < 0) {
+      RPC_LOG("error in pselect error='%s'", strerror(errno));
+      break;
+    }
+    if (ready == 0) {
+      continue; /* hedge point or deadline reached */
+    }
+
+    pkt.data = reply_buffer;
+    ready = transport.recv(&transport, &pkt, 1);
+    if (ready < 0) {
+      RPC_LOG("error recv res='%s'", strerror(errno));
+      break;
+    }
+    if (ready == 0) {
+      continue;
+    }
+
+    result = rpc_reply_result(reply_buffer, pkt.len, request_id, &result_len);
+    if (result == NULL) {
+      continue;
+    }
+
+    /* First reply from any backend we asked wins */
+    for (i = 0; i < sent_count; i++) {
+      if (pkt.addr.sin_addr.s_addr ==
+              client->backends[sent[i]].addr.sin_addr.s_addr &&
+          pkt.addr.sin_port == client->backends[sent[i]].addr.sin_port) {
+        winner = i;
+        if (result_len >= response_size) {
+          result_len = response_size - 1;
+        }
+        memcpy(response, result, result_len);
+        response[result_len] = '\0';
+        break;
+      }
+    }
+  }
+
+  close(st.fd);
+
+  now_us = rpc_mono_us();
+  for (i = 0; i < sent_count; i++) {
+    atomic_fetch_sub(&client->backends[sent[i]].in_flight, 1);
+    if (winner < 0) {
+      rpc_client_record(client, &client->backends[sent[i]],
+                        now_us - sent_at[i], false);
+    }
+  }
+
+  if (winner < 0) {
+    return RPC_ERROR;
+  }
+
+  rpc_client_record(client, &client->backends[sent[winner]],
+                    now_us - sent_at[winner], true);
+  return RPC_SUCCESS;
+}
+
+int32_t rpc_transport_call(rpc_transport_t *transport, int32_t timeout_ms,
+                           int32_t argc, char **argv, char *response,
+                           size_t response_size) {
+  return rpc_transport_request(transport, NULL, timeout_ms, argc, argv,
+                               response, response_size);
+}
+
+/* Size a socket buffer, SO_*BUFFORCE lifts the rmem/wmem_max cap if allowed */
+static int32_t rpc_set_sockbuf(int sock, int opt, int force_opt,
+                               int32_t bytes) {
+  int32_t actual = 0;
+  socklen_t len = sizeof(actual);
+
+  if (bytes > 0) {
+    if (setsockopt(sock, SOL_SOCKET, opt, &bytes, sizeof(bytes)) < 0) {
+      RPC_LOG("error set socket buffer error='%s'", strerror(errno));
+    }
+    if (getsockopt(sock, SOL_SOCKET, opt, &actual, &len) == 0 &&
+        actual / 2 < bytes) {
+      setsockopt(sock, SOL_SOCKET, force_opt, &bytes, sizeof(bytes));
+    }
+  }
+
+  /*
+   * The kernel reports twice the size it granted to account for overhead,
+   * halve it so the result compares with the request
+   */
+  len = sizeof(actual);
+  if (getsockopt(sock, SOL_SOCKET, opt, &actual, &len) < 0) {
+    return 0;
+  }
+  actual /= 2;
+  if (bytes > 0 && actual < bytes) {
+    RPC_LOG("socket buffer capped requested=%d actual=%d", bytes, actual);
+  }
+  return actual;
+}
+
+/* Start serving on an already bound UDP socket, takes ownership of sock */
+static rpc_context_t *rpc_start(int sock, const rpc_options_t *opts) {
+  int32_t on = 1;
+
+  /* Initialize the keep_running flag */
+  atomic_store(&g_ctx.keep_running, true);
+  atomic_store(&g_ctx.expired_drops, 0);
+  atomic_store(&g_ctx.pushes_sent, 0);
+  atomic_store(&g_ctx.push_pending, false);
+  atomic_store(&g_ctx.handoff_fd, -1);
+  g_ctx.handoff_path[0] = '\0';
+  g_ctx.topic_count = 0;
+  pthread_mutex_init(&g_ctx.pubsub_lock, NULL);
+  rpc_sub_key_init();
+  atomic_store(&g_ctx.kernel_drops, 0);
+  atomic_store(&g_ctx.pool_hugepages, false);
+  g_ctx.hugepages = opts != NULL && opts->hugepages;
+  g_ctx.sock_fd = sock;
+  g_udp_state.fd = sock;
+
+  /* Burst absorption: larger queues and a kernel drop counter */
+  g_ctx.rcvbuf_bytes = rpc_set_sockbuf(sock, SO_RCVBUF, SO_RCVBUFFORCE,
+                                       opts != NULL ? opts->rcvbuf : 0);
+  g_ctx.sndbuf_bytes = rpc_set_sockbuf(sock, SO_SNDBUF, SO_SNDBUFFORCE,
+                                       opts != NULL ? opts->sndbuf : 0);
+  if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+    RPC_LOG("error set SO_RXQ_OVFL error='%s'", strerror(errno));
+  }
+
+  /* Kernel arrival stamps, so time in the socket backlog counts against
+   * request deadlines and shows up in traces */
+  if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+    RPC_LOG("error set SO_TIMESTAMPNS error='%s'", strerror(errno));
+  }
+
+  /* Wakes the server thread when a handler publishes */
+  g_ctx.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g_ctx.wake_fd < 0) {
+    RPC_LOG("error create eventfd: %s", strerror(errno));
+    close(g_ctx.sock_fd);
+    g_ctx.sock_fd = -1;
+    return NULL;
+  }
+
+  /* Apply a tracing mode chosen before init */
+  if (atomic_load(&g_trace_sample_every) > 0) {
+    rpc_trace_enable(atomic_load(&g_trace_sample_every));
+  }
+
+  /* Start server thread */
+  if (pthread_create(&g_ctx.server_thread, NULL, rpc_server_thread, NULL) !=
+      0) {
+    RPC_LOG("error create server thread: %s", strerror(errno));
+    close(g_ctx.sock_fd);
+    g_ctx.sock_fd = -1;
+    close(g_ctx.wake_fd);
+    g_ctx.wake_fd = -1;
+    return NULL;
+  }
+
+  return &g_ctx;
+}
+
+rpc_context_t *rpc_init(void) { return rpc_init_port(DEFAULT_RPC_PORT); }
+
+rpc_context_t *rpc_init_port(int32_t port) {
+  rpc_options_t opts;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.port = port;
+  return rpc_init_opts(&opts);
+}
+
+rpc_context_t *rpc_init_opts(const rpc_options_t *opts) {
+  struct sockaddr_in server_addr;
+  int32_t port;
+  int sock;
+
+  if (opts == NULL) {
+    return NULL;
+  }
+
+  port = opts->port;
+  if (port <= 0 || port > UINT16_MAX) {
+    return NULL;
+  }
+
+  /* Create UDP socket */
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    RPC_LOG("error create socket: %s", strerror(errno));
+    return NULL;
+  }
+
+  /* Configure server address */
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  server_addr.sin_port = htons((uint16_t)port);
+
+  /* Bind socket to address */
+  if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    RPC_LOG("error bind socket: %s", strerror(errno));
+    close(sock);
+    return NULL;
+  }
+
+  return rpc_start(sock, opts);
+}
+
+static int32_t rpc_unix_addr(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    return RPC_ERROR;
+  }
+  strcpy(addr->sun_path, path);
+  return RPC_SUCCESS;
+}
+
+rpc_context_t *rpc_init_handoff(const char *path, const rpc_options_t *opts) {
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char cmsg_buf[CMSG_SPACE(sizeof(int))];
+  struct timeval tv;
+  char tag;
+  int unix_sock;
+  int sock = -1;
+  rpc_context_t *ctx;
+
+  if (path == NULL || rpc_unix_addr(path, &addr) != RPC_SUCCESS) {
+    return NULL;
+  }
+
+  unix_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (unix_sock < 0) {
+    RPC_LOG("error create socket: %s", strerror(errno));
+    return NULL;
+  }
+
+  if (connect(unix_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    RPC_LOG("no server to take over path=%s error='%s'", path,
+            strerror(errno));
+    close(unix_sock);
+    return NULL;
+  }
+
+  tv.tv_sec = RPC_DEFAULT_TIMEOUT_SEC;
+  tv.tv_usec = 0;
+  setsockopt(unix_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  /* Receive the listener, it arrives as SCM_RIGHTS next to a one byte tag */
+  iov.iov_base = &tag;
+  iov.iov_len = sizeof(tag);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+
+  if (recvmsg(unix_sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+    RPC_LOG("error recv handoff error='%s'", strerror(errno));
+    close(unix_sock);
+    return NULL;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&sock, CMSG_DATA(cmsg), sizeof(sock));
+    }
+  }
+
+  if (sock < 0) {
+    RPC_LOG("error handoff carried no socket");
+    close(unix_sock);
+    return NULL;
+  }
+
+  /* Serve first, then tell the old process it may stop reading */
+  ctx = rpc_start(sock, opts);
+  if (ctx != NULL) {
+    tag = RPC_HANDOFF_ACK;
+    if (send(unix_sock, &tag, sizeof(tag), MSG_NOSIGNAL) < 0) {
+      RPC_LOG("error send handoff ack error='%s'", strerror(errno));
+    }
+  }
+
+  close(unix_sock);
+  return ctx;
+}
+
+int32_t rpc_handoff_listen(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (path == NULL || !atomic_load(&g_ctx.keep_running) ||
+      rpc_unix_addr(path, &addr) != RPC_SUCCESS) {
+    return RPC_ERROR;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    RPC_LOG("error create socket: %s", strerror(errno));
+    return RPC_ERROR;
+  }
+
+  /* A stale path from a crashed predecessor would make bind fail */
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1) < 0) {
+    RPC_LOG("error listen handoff path=%s error='%s'", path, strerror(errno));
+    close(fd);
+    return RPC_ERROR;
+  }
+
+  strcpy(g_ctx.handoff_path, addr.sun_path);
+  atomic_store(&g_ctx.handoff_fd, fd);
+  return RPC_SUCCESS;
+}
+
+int rpc_deinit(rpc_context_t *ctx) {
+  int handoff_fd;
+
+  if (ctx == NULL) {
+    return EINVAL;
+  }
+
+  // check if rpc server was started, it may have stopped on its own
+  if (ctx->sock_fd < 0) {
+    return EINVAL;
+  }
+  /* Signal the server thread to exit */
+  atomic_store(&ctx->keep_running, false);
+
+  /* Join the server thread */
+  if (pthread_join(ctx->server_thread, NULL) != 0) {
+    RPC_LOG("Failed to join server thread: %s", strerror(errno));
+  }
+
+  /* Close the socket */
+  if (ctx->sock_fd >= 0) {
+    close(ctx->sock_fd);
     ctx->sock_fd = -1;
   }
+  if (ctx->wake_fd >= 0) {
+    close(ctx->wake_fd);
+    ctx->wake_fd = -1;
+  }
+  handoff_fd = atomic_exchange(&ctx->handoff_fd, -1);
+  if (handoff_fd >= 0) {
+    close(handoff_fd);
+    unlink(ctx->handoff_path);
+  }
+  pthread_mutex_destroy(&ctx->pubsub_lock);
   return 0;
 }
@@ -13,7 +13,10 @@
 #define _GNU_SOURCE
 #endif
 
+#include <netinet/in.h>
+#include <pthread.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/select.h>
@@ -27,6 +30,41 @@
 #define DEFAULT_RPC_PORT 8888
 #define MAX_PACKET_SIZE 4096
 #define RPC_BUFFER_SIZE 2048
+#define RPC_MAX_BACKENDS 16
+#define RPC_LATENCY_WINDOW 128
+#define RPC_HEDGE_MIN_SAMPLES 20
+#define RPC_MAX_TOPICS 16
+#define RPC_MAX_SUBSCRIBERS 64
+#define RPC_DEFAULT_LEASE_SEC 30
+#define RPC_MAX_LEASE_SEC 300
+#define RPC_TOPIC_NAME_SIZE 50
+#define RPC_SUBSCRIBE_TOKEN_SIZE 17 /* 16 hex digits and the terminator */
+#define RPC_PUSH_COALESCE_MS 10
+#define RPC_PUSH_BATCH 64
+#define RPC_TRACE_RING_SIZE 4096
+#define RPC_TRACE_MAX_THREADS 16
+#define RPC_HANDOFF_ACK 'H'
+#define RPC_RECV_BATCH 32
+#define RPC_HUGEPAGE_SIZE (2 * 1024 * 1024)
+#define RPC_LOOPBACK_RING_SIZE 256
+#define RPC_CAPTURE_RING_SIZE (4 * 1024 * 1024)
+#define RPC_CAPTURE_MAGIC "RPCCAP\0\0"
+#define RPC_CAPTURE_VERSION 1
+#define RPC_HANDOFF_PATH_SIZE 108 /* sizeof(sockaddr_un.sun_path) */
+
+/* Reserved methods, the '@' prefix is not used by registered functions */
+#define RPC_SUBSCRIBE_METHOD "@sub"
+#define RPC_UNSUBSCRIBE_METHOD "@unsub"
+#define RPC_PUSH_METHOD "@pub"
+
+/* Optional leading argument carrying the caller's time budget in ms */
+#define RPC_DEADLINE_PREFIX "@dl="
+
+/* Optional argument after the budget, echoed as the first part of the reply */
+#define RPC_REQUEST_ID_PREFIX "@id="
+
+/* Reply to a "@sub" without a valid token, followed by the token to echo */
+#define RPC_SUBSCRIBE_TOKEN_PREFIX "@tok="
 
 /* Status codes */
 #define RPC_SUCCESS 0
@@ -54,22 +92,173 @@ typedef struct {
   rpc_string_cb func;
 } rpc_func_t;
 
+/* Stage timestamps of one traced request, CLOCK_REALTIME ns, 0 if unset */
+typedef struct {
+  uint64_t rx_ns;      /* kernel receive (SO_TIMESTAMPNS) */
+  uint64_t dequeue_ns; /* batch returned from transport recv */
+  uint64_t parse_ns;   /* parse_args done */
+  uint64_t dispatch_start_ns;
+  uint64_t dispatch_end_ns;
+  uint64_t send_ns; /* send_result done */
+  char method[24];
+} rpc_trace_span_t;
+
+typedef struct {
+  struct sockaddr_in addr;
+  time_t lease_expiry;   /* monotonic seconds */
+  uint64_t sent_version; /* last topic version pushed to this subscriber */
+} rpc_subscriber_t;
+
+typedef struct {
+  char name[RPC_TOPIC_NAME_SIZE];
+  char message[RPC_BUFFER_SIZE]; /* encoded push: "@pub\0<name>\0<payload>" */
+  size_t header_len;
+  size_t message_len;
+  uint64_t version; /* bumped on every publish, 0 means never published */
+  rpc_subscriber_t subscribers[RPC_MAX_SUBSCRIBERS];
+  uint32_t subscriber_count;
+} rpc_topic_t;
+
 typedef struct {
   rpc_func_t functions[MAX_FUNCTIONS];
   uint32_t function_count;
   int sock_fd;
   atomic_bool keep_running;
   pthread_t server_thread;
+  atomic_uint_fast64_t expired_drops; /* requests dropped past deadline */
+  rpc_topic_t topics[RPC_MAX_TOPICS];
+  uint32_t topic_count;
+  pthread_mutex_t pubsub_lock; /* guards topics */
+  int wake_fd;                 /* eventfd, wakes the server thread on publish */
+  atomic_bool push_pending;
+  atomic_uint_fast64_t pushes_sent;
+  bool hugepages;             /* requested for the packet pool */
+  atomic_bool pool_hugepages; /* packet pool actually on huge pages */
+  int32_t rcvbuf_bytes;       /* granted SO_RCVBUF, as requested (not x2) */
+  int32_t sndbuf_bytes;       /* granted SO_SNDBUF, as requested (not x2) */
+  atomic_uint kernel_drops;   /* datagrams dropped by a full receive queue */
+  atomic_uint_fast64_t capture_drops; /* datagrams the capture ring missed */
+  atomic_int handoff_fd; /* unix listener for a successor, -1 if none */
+  char handoff_path[RPC_HANDOFF_PATH_SIZE];
   char echo_buffer[RPC_BUFFER_SIZE];
 } rpc_context_t;
 
+/* One datagram as seen by a transport */
+typedef struct {
+  char *data; /* at least RPC_MAX_PACKET_SIZE bytes when receiving */
+  size_t len;
+  struct sockaddr_in addr; /* peer */
+  socklen_t addr_len;
+  uint64_t rx_ns; /* kernel receive stamp, 0 if unknown */
+} rpc_packet_t;
+
+/*
+ * Datagram transport under the server and client. recv and send move a
+ * batch without blocking and return how many packets were handled, 0 when
+ * none, RPC_ERROR on failure. wait sleeps up to wait_us until recv may
+ * have packets and returns > 0 if so, 0 on timeout; NULL means callers
+ * busy-poll.
+ */
+typedef struct rpc_transport rpc_transport_t;
+struct rpc_transport {
+  int32_t (*recv)(rpc_transport_t *transport, rpc_packet_t *pkts,
+                  uint32_t max);
+  int32_t (*send)(rpc_transport_t *transport, const rpc_packet_t *pkts,
+                  uint32_t count);
+  int32_t (*wait)(rpc_transport_t *transport, int64_t wait_us);
+  void *priv;
+};
+
+/* In-memory transport: a pair of SPSC rings, one per direction */
+typedef struct rpc_loopback rpc_loopback_t;
+
+/* Capture file layout: one header, then records each followed by len bytes */
+typedef struct {
+  char magic[8]; /* RPC_CAPTURE_MAGIC */
+  uint32_t version;
+  uint32_t reserved;
+} rpc_capture_file_header_t;
+
+typedef struct __attribute__((packed)) {
+  uint64_t ts_ns; /* CLOCK_REALTIME receive time */
+  uint32_t addr;  /* source IPv4, network order */
+  uint16_t port;  /* source port, network order */
+  uint16_t len;   /* datagram length */
+} rpc_capture_record_t;
+
+/* Server start-up options, zero means kernel default */
+typedef struct {
+  int32_t port;
+  int32_t rcvbuf;  /* SO_RCVBUF in bytes */
+  int32_t sndbuf;  /* SO_SNDBUF in bytes */
+  bool hugepages;  /* back the packet buffer pool with MAP_HUGETLB */
+} rpc_options_t;
+
+/* Client side view of one server replica */
+typedef struct {
+  struct sockaddr_in addr;
+  atomic_uint in_flight; /* calls sent and not yet answered */
+  uint64_t ewma_us;      /* smoothed reply latency, 0 until measured */
+} rpc_backend_t;
+
+/* Set of server replicas used for load balancing and hedging */
+typedef struct {
+  rpc_backend_t backends[RPC_MAX_BACKENDS];
+  uint32_t backend_count;
+  bool hedging;
+  pthread_mutex_t lock; /* guards rng, ewma_us and the latency window */
+  uint32_t rng;
+  uint32_t latency_us[RPC_LATENCY_WINDOW];
+  uint32_t latency_pos;
+} rpc_client_t;
+
 /**
- * Initialize the RPC server
+ * Initialize the RPC server on DEFAULT_RPC_PORT
  *
  * @return rpc_context_t * on success, NULL on failure
  */
 rpc_context_t *rpc_init(void);
 
+/**
+ * Initialize the RPC server on the given UDP port
+ *
+ * @param port Port to bind
+ * @return rpc_context_t * on success, NULL on failure
+ */
+rpc_context_t *rpc_init_port(int32_t port);
+
+/**
+ * Initialize the RPC server with explicit options
+ *
+ * @param opts Port, socket buffer sizes and packet pool settings
+ * @return rpc_context_t * on success, NULL on failure
+ */
+rpc_context_t *rpc_init_opts(const rpc_options_t *opts);
+
+/**
+ * Take over the listener of a running server
+ *
+ * Connects to the handoff path of the old process, receives its bound UDP
+ * socket and starts serving on it. The old process stops reading once this
+ * returns, so datagrams queued in between are served by the new process.
+ *
+ * @param path Unix socket path the old process listens on
+ * @param opts Socket buffer and pool settings, port is ignored, may be NULL
+ * @return rpc_context_t * on success, NULL on failure
+ */
+rpc_context_t *rpc_init_handoff(const char *path, const rpc_options_t *opts);
+
+/**
+ * Accept one successor on a unix socket path and hand it the listener
+ *
+ * After a successful handoff keep_running turns false and rpc_deinit only
+ * closes this process's copy of the socket.
+ *
+ * @param path Unix socket path to listen on
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_handoff_listen(const char *path);
+
 /**
  * Clean up and shut down the RPC server
  */
@@ -93,6 +282,94 @@ int32_t rpc_register(const char *name, rpc_cb func);
  */
 int32_t register_str_func(const char *name, rpc_string_cb func);
 
+/**
+ * Publish a new value for a topic
+ *
+ * Subscribers receive the latest value only: updates published within
+ * RPC_PUSH_COALESCE_MS of each other are coalesced into one push. The
+ * first publish creates the topic, clients cannot subscribe before it.
+ *
+ * @param topic Topic name
+ * @param payload Value to push
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_publish(const char *topic, const char *payload);
+
+/**
+ * Enable sampled per-request stage tracing
+ *
+ * May be called before or after rpc_init.
+ *
+ * @param sample_every Trace one request out of this many, 0 disables
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_trace_enable(uint32_t sample_every);
+
+/**
+ * Write the recorded spans as Chrome trace JSON (loadable in Perfetto)
+ *
+ * @param path Output file
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_trace_dump(const char *path);
+
+/**
+ * Start appending every received datagram to a capture file
+ *
+ * Serving threads never block on the file: records go through a ring
+ * and are counted in capture_drops if it is full. Threads serving with
+ * rpc_server_poll alongside the server thread append without locking.
+ *
+ * @param path Capture file, truncated
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_capture_start(const char *path);
+
+/**
+ * Stop capturing and flush the capture file
+ *
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_capture_stop(void);
+
+/**
+ * Serve one batch of requests from a transport on the calling thread
+ *
+ * The calling thread gets its own packet pool on first use, release it with
+ * rpc_server_poll_release.
+ *
+ * @param transport Server side of a transport
+ * @return Number of requests received, 0 if none, RPC_ERROR on failure
+ */
+int32_t rpc_server_poll(rpc_transport_t *transport);
+
+/**
+ * Release the packet pool of a thread that called rpc_server_poll
+ */
+void rpc_server_poll_release(void);
+
+/**
+ * Create an in-memory transport, for measuring dispatch without sockets
+ *
+ * @return rpc_loopback_t * on success, NULL on failure
+ */
+rpc_loopback_t *rpc_loopback_new(void);
+
+/**
+ * Free an in-memory transport
+ */
+void rpc_loopback_free(rpc_loopback_t *lb);
+
+/**
+ * Server end of an in-memory transport, pass it to rpc_server_poll
+ */
+rpc_transport_t *rpc_loopback_server(rpc_loopback_t *lb);
+
+/**
+ * Client end of an in-memory transport, pass it to rpc_transport_call
+ */
+rpc_transport_t *rpc_loopback_client(rpc_loopback_t *lb);
+
 /* Example default commands */
 
 /**
@@ -118,4 +395,130 @@ const char *stop_func(int32_t argc, char **argv);
 int32_t rpc_client_call(const char *server_ip, int32_t port, int32_t argc,
                         char **argv, char *response, size_t response_size);
 
+/**
+ * Send an RPC request with a per-call timeout
+ *
+ * The request carries its time budget (timeout_ms), the server turns it
+ * into a local deadline on receipt and drops the request unprocessed once
+ * that has passed.
+ *
+ * @param server_ip IP address of the RPC server
+ * @param port Server port number
+ * @param timeout_ms Time budget for the call in milliseconds
+ * @param argc Number of arguments (including function name)
+ * @param argv Array of arguments (argv[0] is function name)
+ * @param response Buffer to store response
+ * @param response_size Size of response buffer
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_client_call_timeout(const char *server_ip, int32_t port,
+                                int32_t timeout_ms, int32_t argc, char **argv,
+                                char *response, size_t response_size);
+
+/**
+ * Subscribe to a topic, or renew the lease of an existing subscription
+ *
+ * Pass *sock = -1 to open a new subscription socket. The lease must be
+ * renewed by calling again with the same socket before it expires. A push
+ * that arrives while waiting for the reply is kept for
+ * rpc_subscription_recv. Only topics a handler has already published to
+ * can be subscribed.
+ *
+ * Pushes are unsolicited traffic to the subscriber's address, which a
+ * spoofed request could aim at a victim. The server therefore answers a
+ * "@sub" with a token bound to the source address and only registers
+ * the address once the token is echoed back; this call does both steps.
+ * Leases are capped at RPC_MAX_LEASE_SEC to bound stale subscriptions.
+ *
+ * @param sock In/out subscription socket
+ * @param server_ip IP address of the RPC server
+ * @param port Server port number
+ * @param topic Topic name
+ * @param lease_sec Lease in seconds
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_subscribe(int32_t *sock, const char *server_ip, int32_t port,
+                      const char *topic, int32_t lease_sec);
+
+/**
+ * Wait for the next push on a subscription socket
+ *
+ * @param sock Subscription socket from rpc_subscribe
+ * @param timeout_ms How long to wait in milliseconds
+ * @param topic Buffer to store the topic name
+ * @param topic_size Size of topic buffer
+ * @param payload Buffer to store the pushed value
+ * @param payload_size Size of payload buffer
+ * @return RPC_SUCCESS on success, RPC_ERROR on timeout or failure
+ */
+int32_t rpc_subscription_recv(int32_t sock, int32_t timeout_ms, char *topic,
+                              size_t topic_size, char *payload,
+                              size_t payload_size);
+
+/**
+ * Send an RPC request over a transport and wait for the response
+ *
+ * Another thread must be serving the other end, e.g. with rpc_server_poll.
+ * Transports without a wait hook, like the loopback, are busy-polled.
+ *
+ * @param transport Client side of a transport
+ * @param timeout_ms Time budget for the call in milliseconds
+ * @param argc Number of arguments (including function name)
+ * @param argv Array of arguments (argv[0] is function name)
+ * @param response Buffer to store response
+ * @param response_size Size of response buffer
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_transport_call(rpc_transport_t *transport, int32_t timeout_ms,
+                           int32_t argc, char **argv, char *response,
+                           size_t response_size);
+
+/**
+ * Create an empty server set
+ *
+ * @return rpc_client_t * on success, NULL on failure
+ */
+rpc_client_t *rpc_client_new(void);
+
+/**
+ * Free a server set created with rpc_client_new
+ */
+void rpc_client_free(rpc_client_t *client);
+
+/**
+ * Add a server replica to the set
+ *
+ * @param client Server set
+ * @param server_ip IP address of the RPC server
+ * @param port Server port number
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_client_add_server(rpc_client_t *client, const char *server_ip,
+                              int32_t port);
+
+/**
+ * Enable hedged requests: if no reply arrives within the observed p95
+ * latency, a duplicate is sent to a second replica
+ */
+void rpc_client_set_hedging(rpc_client_t *client, bool enable);
+
+/**
+ * Send an RPC request to one replica of the set and wait for a response
+ *
+ * The replica is picked with power-of-two-choices on smoothed latency and
+ * in-flight calls. With hedging enabled the first reply of either replica
+ * wins.
+ *
+ * @param client Server set
+ * @param timeout_ms Time budget for the call in milliseconds
+ * @param argc Number of arguments (including function name)
+ * @param argv Array of arguments (argv[0] is function name)
+ * @param response Buffer to store response
+ * @param response_size Size of response buffer
+ * @return RPC_SUCCESS on success, RPC_ERROR on failure
+ */
+int32_t rpc_client_call_set(rpc_client_t *client, int32_t timeout_ms,
+                            int32_t argc, char **argv, char *response,
+                            size_t response_size);
+
 #endif /* RPC_H */
\ No newline at end of file